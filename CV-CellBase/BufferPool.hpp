@@ -0,0 +1,144 @@
+#pragma once
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Recycles cv::Mat buffers between frames. Mats from acquire carry the pool as their allocator, so
+// when the last Mat referring to a buffer goes away OpenCV hands the buffer back to the pool, which
+// files it on a free list for its size and type. Callers never give buffers back themselves, and
+// acquiring one is a pop from that list. With a constant frame size the filters draw the same
+// buffers every frame and stop allocating after the first one.
+class BufferPool : public cv::MatAllocator {
+public:
+	// A free buffer not reused for this many acquisitions from the pool is released, so buffers of
+	// a size that stopped coming up (the frame size changed) do not stay around.
+	uint64_t maxIdleAge = 1 << 16;
+
+	// The process-wide pool the filters draw from. It is never destroyed, as Mats drawn from it may
+	// outlive static destructors.
+	static BufferPool& shared() {
+		static BufferPool* pool = new BufferPool();
+		return *pool;
+	}
+
+	// Contents are left over from an earlier use, as those of cv::Mat(size, type) are undefined.
+	cv::Mat acquire(cv::Size size, int type) {
+		cv::Mat mat;
+		mat.allocator = this;
+		mat.create(size, type);
+		return mat;
+	}
+
+	cv::Mat acquire(cv::Size size, int type, const cv::Scalar& value) {
+		cv::Mat mat = acquire(size, type);
+		mat.setTo(value);
+		return mat;
+	}
+
+	cv::Mat clone(const cv::Mat& img) {
+		cv::Mat mat = acquire(img.size(), img.type());
+		img.copyTo(mat);
+		return mat;
+	}
+
+	// Releases every free buffer.
+	void trim() {
+		std::lock_guard<std::mutex> lock(mutex);
+		releaseIdle(0);
+	}
+
+	size_t bytes() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t total = 0;
+		for (const auto& [u, buffer] : buffers) {
+			total += u->size;
+		}
+		return total;
+	}
+
+	// Buffers are made by the default allocator at the time and keep the pool as their allocator
+	// until released.
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+		const bool isPooled = dims == 2 && data == nullptr;
+		if (isPooled) {
+			std::lock_guard<std::mutex> lock(mutex);
+			clock++;
+			if (clock % sweepInterval == 0) {
+				releaseIdle(maxIdleAge);
+			}
+
+			auto found = freeBuffers.find(Key(sizes[0], sizes[1], type));
+			if (found != freeBuffers.end() && !found->second.empty()) {
+				cv::UMatData* u = found->second.back().u;
+				found->second.pop_back();
+				step[1] = CV_ELEM_SIZE(type);
+				step[0] = sizes[1] * step[1];
+				return u;
+			}
+		}
+
+		cv::UMatData* u = cv::Mat::getDefaultAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+		if (isPooled && u != nullptr) {
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers[u] = Buffer{ Key(sizes[0], sizes[1], type), u->currAllocator };
+			u->currAllocator = this;
+		}
+		return u;
+	}
+
+	bool allocate(cv::UMatData* data, cv::AccessFlag, cv::UMatUsageFlags) const override {
+		return data != nullptr;
+	}
+
+	// Called by OpenCV once the last Mat referring to the buffer is gone.
+	void deallocate(cv::UMatData* u) const override {
+		std::lock_guard<std::mutex> lock(mutex);
+		freeBuffers[buffers.at(u).key].push_back(FreeBuffer{ u, clock });
+	}
+
+private:
+	using Key = std::tuple<int, int, int>; // rows, cols, type
+
+	struct Buffer {
+		Key key;
+		const cv::MatAllocator* owner; // the allocator that made it, which frees it
+	};
+
+	struct FreeBuffer {
+		cv::UMatData* u;
+		uint64_t lastReleased = 0;
+	};
+
+	static constexpr uint64_t sweepInterval = 1024;
+
+	mutable std::mutex mutex;
+	mutable std::unordered_map<cv::UMatData*, Buffer> buffers;
+	mutable std::map<Key, std::vector<FreeBuffer>> freeBuffers;
+	mutable uint64_t clock = 0;
+
+	BufferPool() {}
+
+	void releaseIdle(uint64_t idleAge) const {
+		for (auto it = freeBuffers.begin(); it != freeBuffers.end();) {
+			auto& entries = it->second;
+			std::erase_if(entries, [&](const FreeBuffer& entry) {
+				if (clock - entry.lastReleased < idleAge) {
+					return false;
+				}
+
+				const auto owner = buffers.at(entry.u).owner;
+				buffers.erase(entry.u);
+				entry.u->currAllocator = owner;
+				owner->deallocate(entry.u);
+				return true;
+			});
+			it = entries.empty() ? freeBuffers.erase(it) : std::next(it);
+		}
+	}
+};
@@ -1,9 +1,13 @@
-#include "Filter.hpp"
+#pragma once
+#include <bit>
 
-constexpr std::int_fast32_t _256 = 256;
+#include "Filter.hpp"
 
 class CellBlur : public Filter {
 public:
+	// Side of the blocks of the occupancy map; the blur only visits blocks holding labelled pixels.
+	static constexpr int blockSize = 32;
+
 	std::vector<float> kernel;
 	std::vector<std::vector<cv::Vec3b>> targets;
 
@@ -24,161 +28,267 @@ public:
 		}
 	}
 
-	cv::Mat_<int_fast32_t> convertToIntImg(const cv::Mat& srcImg, int* _startNotWhiteX, int* _startNotWhiteY, int* _endNotWhiteX, int* _endNotWhiteY) {
-		cv::Mat_<int_fast32_t> iSrcImg(srcImg.size());
-
-		const int size = srcImg.rows * srcImg.cols;
-		constexpr int_fast32_t white = 255 + 255 * _256 + 255 * _256 * _256;
-
-		auto srcData = reinterpret_cast<cv::Vec3b*>(srcImg.data);
-		auto iSrcData = reinterpret_cast<int_fast32_t*>(iSrcImg.data);
-
-		int startNotWhiteX = srcImg.cols - 1;
-		int startNotWhiteY = srcImg.rows - 1;
-		int endNotWhiteX = 0;
-		int endNotWhiteY = 0;
-
-		int i = 0;
-		for (int imgY = 0; imgY < srcImg.rows; imgY++) {
-			for (int imgX = 0; imgX < srcImg.cols; imgX++) {
-				auto iSrcPixel = srcData[i][0] + srcData[i][1] * _256 + srcData[i][2] * _256 * _256;
-				iSrcData[i] = iSrcPixel;
-				i++;
-				if (iSrcPixel != white) {
-					startNotWhiteX = std::min(startNotWhiteX, imgX);
-					startNotWhiteY = std::min(startNotWhiteY, imgY);
-					endNotWhiteX = std::max(endNotWhiteX, imgX);
-					endNotWhiteY = std::max(endNotWhiteY, imgY);
+	// Groups are blurred one after another on the same image, so a group sharing a color with an
+	// earlier one reads pixels that group already blurred, and the reach adds up along such chains.
+	cv::Size halo() const {
+		std::vector<int> depths(targets.size(), 1);
+		int maxDepth = 1;
+		for (size_t i = 0; i < targets.size(); i++) {
+			for (size_t j = 0; j < i; j++) {
+				const bool isShared = std::any_of(targets[i].begin(), targets[i].end(), [&](const cv::Vec3b& color) {
+					return std::find(targets[j].begin(), targets[j].end(), color) != targets[j].end();
+				});
+				if (isShared) {
+					depths[i] = std::max(depths[i], depths[j] + 1);
 				}
 			}
+			maxDepth = std::max(maxDepth, depths[i]);
 		}
 
-		*_startNotWhiteX = startNotWhiteX;
-		*_startNotWhiteY = startNotWhiteY;
-		*_endNotWhiteX = endNotWhiteX;
-		*_endNotWhiteY = endNotWhiteY;
-
-		return iSrcImg;
+		const int kernelCenter = static_cast<int>(kernel.size()) / 2;
+		return cv::Size(kernelCenter * maxDepth, kernelCenter * maxDepth);
 	}
 
-	cv::Mat_<bool> _createTargetFlagImg(cv::Mat_<int_fast32_t> srcImg, std::vector<cv::Vec3b> _target, int* _startImgX, int* _startImgY, int* _endImgX, int* _endImgY, int startNotWhiteX, int startNotWhiteY, int endNotWhiteX, int endNotWhiteY) {
-		auto dstImg = cv::Mat_<bool>(srcImg.size());
+	bool isLocal() const {
+		return true;
+	}
 
-		bool inWhite = std::find(_target.begin(), _target.end(), cv::Vec3b(255, 255, 255)) != _target.end();
-		if (inWhite == true) {
-			startNotWhiteX = 0;
-			startNotWhiteY = 0;
-			endNotWhiteX = srcImg.cols - 1;
-			endNotWhiteY = srcImg.rows - 1;
+	std::string signature() const {
+		std::ostringstream stream;
+		stream << "CellBlur(" << std::setprecision(9);
+		for (const auto weight : kernel) {
+			stream << weight << ",";
 		}
+		for (const auto& targetColors : targets) {
+			stream << "[";
+			for (const auto& color : targetColors) {
+				stream << color << ",";
+			}
+			stream << "]";
+		}
+		stream << ")";
+		return stream.str();
+	}
 
-		const auto srcData = reinterpret_cast<int_fast32_t*>(srcImg.data);
-		auto dstData = reinterpret_cast<bool*>(dstImg.data);
-		int size = srcImg.rows * srcImg.cols;
+	static cv::Vec4i unionBox(const cv::Vec4i& box1, const cv::Vec4i& box2) {
+		return cv::Vec4i(std::min(box1[0], box2[0]), std::min(box1[1], box2[1]), std::max(box1[2], box2[2]), std::max(box1[3], box2[3]));
+	}
 
-		std::vector<std::int_fast32_t> target;
-		for (int i = 0; i < _target.size(); i++) {
-			target.push_back(_target[i][0] + _target[i][1] * _256 + _target[i][2] * _256 * _256);
+	// One pass over the image labels every pixel with the bitmask of the groups (at most 8) its color
+	// belongs to, and collects the bounding box {startX, startY, endX, endY} of each group along with
+	// blockLabelImg, the union of the labels in each blockSize x blockSize block.
+	template<typename T>
+	cv::Mat_<uchar> createLabelImg(const cv::Mat& srcImg, const std::vector<std::vector<cv::Vec3b>>& groups, std::vector<cv::Vec4i>& labelBoxes, cv::Mat_<uchar>& blockLabelImg) {
+		CV_Assert(groups.size() <= 8);
+
+		cv::Mat_<uchar> labelImg = BufferPool::shared().acquire(srcImg.size(), CV_8UC1);
+		blockLabelImg = BufferPool::shared().acquire(cv::Size((srcImg.cols + blockSize - 1) / blockSize, (srcImg.rows + blockSize - 1) / blockSize), CV_8UC1, 0);
+
+		std::vector<ColorRule> rules;
+		for (size_t i = 0; i < groups.size(); i++) {
+			for (const auto& color : groups[i]) {
+				rules.push_back(ColorRule{ color, 0, static_cast<int>(i) });
+			}
 		}
-		target.push_back(-1);
-		sort(target.rbegin(), target.rend());
-
-		int startImgX = srcImg.cols - 1;
-		int startImgY = srcImg.rows - 1;
-		int endImgX = 0;
-		int endImgY = 0;
-
-		for (int imgY = startNotWhiteY; imgY <= endNotWhiteY; imgY++) {
-			int i = imgY * srcImg.cols + startNotWhiteX;
-			for (int imgX = startNotWhiteX; imgX <= endNotWhiteX; imgX++) {
-				auto srcPixel = srcData[i];
-
-				bool isTarget = false;
-				for (int i = 0; srcPixel <= target[i]; i++) {
-					if (target[i] == srcPixel) {
-						isTarget = true;
+		const ColorClassifier classifier(rules);
+		const cv::Vec4i emptyBox(srcImg.cols - 1, srcImg.rows - 1, 0, 0);
+
+		// Bands are whole block rows, so no two bands touch the same block.
+		labelBoxes = TileScheduler::rowBands(blockSize).reduce(srcImg.size(), cv::Size(0, 0),
+			std::vector<cv::Vec4i>(groups.size(), emptyBox),
+			[&](const Tile& tile) {
+				std::vector<cv::Vec4i> boxes(groups.size(), emptyBox);
+
+				for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+					auto srcData = srcImg.ptr<T>(imgY);
+					auto labelData = labelImg.ptr<uchar>(imgY);
+					auto blockLabelData = blockLabelImg.ptr<uchar>(imgY / blockSize);
+
+					classifier.classifyRow(srcData, labelData, srcImg.cols);
+					for (int imgX = 0; imgX < srcImg.cols; imgX++) {
+						const uchar label = labelData[imgX];
+						blockLabelData[imgX / blockSize] |= label;
+						for (uchar bits = label; bits != 0; bits &= bits - 1) {
+							auto& box = boxes[std::countr_zero(bits)];
+							box = unionBox(box, cv::Vec4i(imgX, imgY, imgX, imgY));
+						}
 					}
 				}
 
-				if (isTarget) {
-					dstData[i] = true;
-					startImgX = std::min(startImgX, imgX);
-					startImgY = std::min(startImgY, imgY);
-					endImgX = std::max(endImgX, imgX);
-					endImgY = std::max(endImgY, imgY);
+				return boxes;
+			},
+			[](std::vector<cv::Vec4i> boxes1, std::vector<cv::Vec4i> boxes2) {
+				for (size_t i = 0; i < boxes1.size(); i++) {
+					boxes1[i] = unionBox(boxes1[i], boxes2[i]);
 				}
-				i++;
-			}
-		}
-
-		*_startImgX = startImgX;
-		*_startImgY = startImgY;
-		*_endImgX = endImgX;
-		*_endImgY = endImgY;
+				return boxes1;
+			});
 
-		return dstImg;
+		return labelImg;
 	}
 
-	cv::Mat_<cv::Vec3f> _apply(cv::Mat_<cv::Vec3f>& srcImg, const cv::Mat_<bool>& targetFlagImg, int startImgX, int startImgY, int endImgX, int endImgY) {
-		cv::Mat_<cv::Vec4f> dstImgY(srcImg.size());
-
+	// Masked normalized convolution: every labelled pixel becomes the Gaussian-weighted mean of the
+	// labelled pixels around it, on planar float rows. The mask is a 0/1 plane, so a sample that is not
+	// labelled adds w * 0 instead of being branched around, which keeps the sums bit-identical to
+	// skipping it. The horizontal pass writes B, G, R and weight planes already multiplied by the
+	// mask, and the vertical pass accumulates whole rows of them.
+	// Both passes only visit blocks of blockLabelImg holding the label. Sums of the other blocks are
+	// all zero, so the vertical pass skips them too and they are never stored.
+	cv::Mat_<cv::Vec3f> _apply(cv::Mat_<cv::Vec3f>& srcImg, const cv::Mat_<uchar>& labelImg, const cv::Mat_<uchar>& blockLabelImg, uchar label, int startImgX, int startImgY, int endImgX, int endImgY) {
 		const int kernelSize = static_cast<int>(kernel.size());
 		const int kernelCenter = kernelSize / 2;
 
-		for (int imgY = startImgY; imgY <= endImgY; imgY++) {
-			for (int imgX = startImgX; imgX < endImgX; imgX++) {
-				if (targetFlagImg(imgY, imgX)) {
-					cv::Vec4f dstImgPixel(0, 0, 0, 0);
-					for (int kernelIdx = 0; kernelIdx < kernelSize; kernelIdx++) {
-						auto imgSampleX = std::clamp(imgX + kernelIdx - kernelCenter, 0, srcImg.cols - 1);
-						if (targetFlagImg(imgY, imgSampleX)) {
-							auto weight = kernel[kernelIdx];
-							auto srcImgPixel = srcImg(imgY, imgSampleX);
-							auto srcImgPixel_weighted = srcImgPixel * weight;
-							dstImgPixel += cv::Vec4f(srcImgPixel_weighted[0], srcImgPixel_weighted[1], srcImgPixel_weighted[2], weight);
+		const cv::Rect targetRect(startImgX, startImgY, endImgX - startImgX + 1, endImgY - startImgY + 1);
+		if (targetRect.empty()) {
+			return srcImg;
+		}
+
+		std::vector<cv::Point> blocks;
+		cv::Mat_<int> blockIndexImg = BufferPool::shared().acquire(blockLabelImg.size(), CV_32SC1, -1);
+		for (int blockY = targetRect.y / blockSize; blockY <= endImgY / blockSize; blockY++) {
+			for (int blockX = targetRect.x / blockSize; blockX <= endImgX / blockSize; blockX++) {
+				if (blockLabelImg(blockY, blockX) & label) {
+					blockIndexImg(blockY, blockX) = static_cast<int>(blocks.size());
+					blocks.push_back(cv::Point(blockX, blockY));
+				}
+			}
+		}
+
+		constexpr int planeCount = 4; // B, G, R, weight
+		constexpr int planeSize = blockSize * blockSize;
+		const int paddedLength = blockSize + kernelSize - 1;
+
+		// Horizontal sums of each visited block, plane after plane, rows blockSize floats apart, one
+		// block per row. The row count is rounded up to a power of two, so frames whose block counts
+		// differ a little draw the same pooled buffer.
+		cv::Mat_<float> blockSums = BufferPool::shared().acquire(cv::Size(planeCount * planeSize, static_cast<int>(std::bit_ceil(blocks.size()))), CV_32FC1);
+		auto blockRectOf = [&](int blockIndex) {
+			return cv::Rect(blocks[blockIndex].x * blockSize, blocks[blockIndex].y * blockSize, blockSize, blockSize) & cv::Rect(0, 0, srcImg.cols, srcImg.rows);
+		};
+		auto blockSumRow = [&](int blockIndex, int plane, int blockRow) {
+			return blockSums.ptr<float>(blockIndex) + plane * planeSize + blockRow * blockSize;
+		};
+
+		scheduler.runRange(static_cast<int>(blocks.size()), 4, [&](const cv::Range& range) {
+			std::vector<float> srcRows(static_cast<size_t>(planeCount) * paddedLength);
+
+			for (int blockIndex = range.start; blockIndex < range.end; blockIndex++) {
+				const cv::Rect blockRect = blockRectOf(blockIndex);
+				const int length = blockRect.width;
+				const int rowLength = length + kernelSize - 1;
+
+				for (int imgY = blockRect.y; imgY < blockRect.y + blockRect.height; imgY++) {
+					const auto srcData = srcImg.ptr<cv::Vec3f>(imgY);
+					const auto labelData = labelImg.ptr<uchar>(imgY);
+
+					// Samples off the image repeat its edge pixels, as a clamped read would.
+					for (int i = 0; i < rowLength; i++) {
+						const int imgX = std::clamp(blockRect.x - kernelCenter + i, 0, srcImg.cols - 1);
+						const bool isTarget = labelData[imgX] & label;
+
+						for (int c = 0; c < 3; c++) {
+							srcRows[c * paddedLength + i] = isTarget ? srcData[imgX][c] : 0.0f;
 						}
+						srcRows[3 * paddedLength + i] = isTarget ? 1.0f : 0.0f;
+					}
+
+					const float* maskRow = srcRows.data() + 3 * paddedLength + kernelCenter;
+					for (int plane = 0; plane < planeCount; plane++) {
+						float* dstRow = blockSumRow(blockIndex, plane, imgY - blockRect.y);
+						convolution::convolveRow(srcRows.data() + plane * paddedLength, dstRow, length, kernel, 1);
+						convolution::multiplyRow(dstRow, maskRow, dstRow, length);
 					}
-					dstImgY(imgY, imgX) = dstImgPixel;
 				}
 			}
-		}
+		});
 
 		auto& dstImg = srcImg;
 
-		for (int imgY = startImgY; imgY <= endImgY; imgY++) {
-			for (int imgX = startImgX; imgX <= endImgX; imgX++) {
-				if (targetFlagImg(imgY, imgX)) {
-					cv::Vec4f dstImgPixel(0, 0, 0);
+		scheduler.runRange(static_cast<int>(blocks.size()), 4, [&](const cv::Range& range) {
+			std::vector<float> accRows(static_cast<size_t>(planeCount) * blockSize);
+
+			for (int blockIndex = range.start; blockIndex < range.end; blockIndex++) {
+				const cv::Rect blockRect = blockRectOf(blockIndex);
+				const int length = blockRect.width;
+
+				for (int imgY = blockRect.y; imgY < blockRect.y + blockRect.height; imgY++) {
+					std::fill(accRows.begin(), accRows.end(), 0.0f);
+
 					for (int kernelIdx = 0; kernelIdx < kernelSize; kernelIdx++) {
-						auto imgSampleY = std::clamp(imgY + kernelIdx - kernelCenter, 0, srcImg.rows - 1);
-						if (targetFlagImg(imgSampleY, imgX)) {
-							auto weight = kernel[kernelIdx];
-							auto srcImgPixel = dstImgY(imgSampleY, imgX);
-							dstImgPixel += srcImgPixel * weight;
+						const int sampleY = std::clamp(imgY + kernelIdx - kernelCenter, 0, srcImg.rows - 1);
+						const int sampleBlockIndex = blockIndexImg(sampleY / blockSize, blocks[blockIndex].x);
+						if (sampleBlockIndex < 0) {
+							continue;
+						}
+
+						for (int plane = 0; plane < planeCount; plane++) {
+							convolution::accumulateRow(blockSumRow(sampleBlockIndex, plane, sampleY % blockSize), accRows.data() + plane * blockSize, length, kernel[kernelIdx]);
+						}
+					}
+
+					auto dstData = dstImg.ptr<cv::Vec3f>(imgY) + blockRect.x;
+					const auto labelData = labelImg.ptr<uchar>(imgY) + blockRect.x;
+					for (int blockX = 0; blockX < length; blockX++) {
+						if (labelData[blockX] & label) {
+							const float scale = 1.0f / accRows[3 * blockSize + blockX];
+							for (int c = 0; c < 3; c++) {
+								dstData[blockX][c] = accRows[c * blockSize + blockX] * scale;
+							}
 						}
 					}
-					dstImg(imgY, imgX) = *reinterpret_cast<cv::Vec3f*>(&dstImgPixel) / dstImgPixel[3];
 				}
 			}
-		}
+		});
 
 		return dstImg;
 	}
 
-	cv::Mat apply(cv::Mat srcImg) {
-		int startNotWhiteX, startNotWhiteY, endNotWhiteX, endNotWhiteY;
-		auto iSrcImg = convertToIntImg(srcImg, &startNotWhiteX, &startNotWhiteY, &endNotWhiteX, &endNotWhiteY);
+	// The first 3 channels are blurred as float B, G, R and a fourth is kept as is. Target colors
+	// are 8-bit and are scaled to the depth of deeper pixels (see ColorClassifier::classify).
+	template<typename T>
+	cv::Mat applyPixels(const cv::Mat& srcImg) {
+		using Sample = typename T::value_type;
 
-		cv::Mat_<cv::Vec3f> img = srcImg;
+		cv::Mat_<cv::Vec3f> img = BufferPool::shared().acquire(srcImg.size(), CV_32FC3);
+		for (int imgY = 0; imgY < srcImg.rows; imgY++) {
+			auto srcRow = srcImg.ptr<T>(imgY);
+			auto imgRow = img.ptr<cv::Vec3f>(imgY);
+			for (int imgX = 0; imgX < srcImg.cols; imgX++) {
+				imgRow[imgX] = cv::Vec3f(srcRow[imgX][0], srcRow[imgX][1], srcRow[imgX][2]);
+			}
+		}
 
+		// Groups are still blurred one after another, each reading the previous result, but share one
+		// label image per batch of 8 instead of rescanning the frame per group.
+		for (size_t batchStart = 0; batchStart < targets.size(); batchStart += 8) {
+			const std::vector<std::vector<cv::Vec3b>> groups(targets.begin() + batchStart, targets.begin() + std::min(batchStart + 8, targets.size()));
 
-		for (auto target : targets) {
-			int startImgX, startImgY, imgEndX, imgEndY;
-			auto targetFlagImg = _createTargetFlagImg(iSrcImg, target, &startImgX, &startImgY, &imgEndX, &imgEndY, startNotWhiteX, startNotWhiteY, endNotWhiteX, endNotWhiteY);
-			img = _apply(img, targetFlagImg, startImgX, startImgY, imgEndX, imgEndY);
+			std::vector<cv::Vec4i> labelBoxes;
+			cv::Mat_<uchar> blockLabelImg;
+			auto labelImg = createLabelImg<T>(srcImg, groups, labelBoxes, blockLabelImg);
+
+			for (size_t i = 0; i < groups.size(); i++) {
+				const auto& box = labelBoxes[i];
+				img = _apply(img, labelImg, blockLabelImg, static_cast<uchar>(1 << i), box[0], box[1], box[2], box[3]);
+			}
 		}
 
-		cv::Mat_<cv::Vec3b> dstImg = img;
+		cv::Mat dstImg = BufferPool::shared().clone(srcImg);
+		for (int imgY = 0; imgY < srcImg.rows; imgY++) {
+			auto imgRow = img.ptr<cv::Vec3f>(imgY);
+			auto dstRow = dstImg.ptr<T>(imgY);
+			for (int imgX = 0; imgX < srcImg.cols; imgX++) {
+				for (int c = 0; c < 3; c++) {
+					dstRow[imgX][c] = cv::saturate_cast<Sample>(imgRow[imgX][c]);
+				}
+			}
+		}
 		return dstImg;
 	}
+
+	cv::Mat apply(cv::Mat srcImg) {
+		return dispatchPixelType(srcImg.type(), [&]<typename T>(T) {
+			return applyPixels<T>(srcImg);
+		});
+	}
 };
@@ -0,0 +1,148 @@
+#pragma once
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <sstream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "Filter.hpp"
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3"). The output is a
+// function of the counter and the key only, so any pixel's numbers can be drawn directly, in any
+// order, on any thread.
+struct Philox4x32 {
+	static std::array<uint32_t, 4> generate(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key) {
+		for (int round = 0; round < 10; round++) {
+			if (round > 0) {
+				key[0] += 0x9E3779B9u;
+				key[1] += 0xBB67AE85u;
+			}
+
+			const uint64_t product0 = static_cast<uint64_t>(0xD2511F53u) * counter[0];
+			const uint64_t product1 = static_cast<uint64_t>(0xCD9E8D57u) * counter[2];
+			counter = {
+				static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0],
+				static_cast<uint32_t>(product1),
+				static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1],
+				static_cast<uint32_t>(product0),
+			};
+		}
+		return counter;
+	}
+};
+
+// Chalk-like line art: the Sobel edges, softened, get per-channel Gaussian noise added modulo 256
+// and are turned to gray, keeping only pixels where the softened edges are not black.
+// Everything is done tile by tile in one pass. The noise of a pixel comes from Philox keyed by seed
+// with the pixel position and frameIndex as the counter, so it needs no buffer, is the same whatever
+// the tiling, and a render can be reproduced exactly. IncrementalProcessor::process sets frameIndex
+// for each frame through setFrameIndex.
+class ChalkFilter : public Filter {
+public:
+	uint64_t seed;
+	uint64_t frameIndex = 0;
+	double noiseMean = 300.0;
+	double noiseSigma = 200.0;
+
+	ChalkFilter(uint64_t _seed = 0) : seed(_seed) {}
+
+	cv::Size halo() const {
+		return sobel.halo() + blur.halo();
+	}
+
+	std::string signature() const {
+		std::ostringstream stream;
+		stream << "ChalkFilter(" << seed << "," << frameIndex << "," << noiseMean << "," << noiseSigma << ")";
+		return stream.str();
+	}
+
+	cv::Mat apply(cv::Mat srcImg) {
+		auto dstImg = BufferPool::shared().acquire(srcImg.size(), CV_8UC1);
+
+		dispatchPixelType(srcImg.type(), [&]<typename T>(T) {
+			applyPixels<T>(srcImg, dstImg);
+		});
+
+		return dstImg;
+	}
+
+	bool isFrameDependent() const {
+		return true;
+	}
+
+	void setFrameIndex(uint64_t _frameIndex) {
+		frameIndex = _frameIndex;
+	}
+
+private:
+	SobelAbsXY sobel;
+	FixedGaussianBlur<3, 2.0f> blur;
+
+	// Deeper softened edges are taken at their nearest 8-bit color, where the noise is added.
+	template<typename T>
+	void applyPixels(const cv::Mat& srcImg, cv::Mat& dstImg) {
+		const cv::Rect imgRect(0, 0, srcImg.cols, srcImg.rows);
+
+		scheduler.run(srcImg.size(), cv::Size(0, 0), [&](const Tile& tile) {
+			auto grow = [&](cv::Size margin) {
+				return cv::Rect(tile.rect.x - margin.width, tile.rect.y - margin.height, tile.rect.width + 2 * margin.width, tile.rect.height + 2 * margin.height) & imgRect;
+			};
+
+			// Each stage runs on a crop wide enough for the stages after it, as in Pipeline.
+			const cv::Rect sobelRect = grow(halo());
+			const cv::Rect blurRect = grow(blur.halo());
+			cv::Mat edgeImg = sobel.apply(srcImg(sobelRect));
+			cv::Mat lineImg = blur.apply(edgeImg(blurRect - sobelRect.tl()));
+			lineImg = lineImg(tile.rect - blurRect.tl());
+
+			for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+				auto lineRow = lineImg.ptr<T>(imgY - tile.rect.y);
+				auto dstRow = dstImg.ptr<uchar>(imgY);
+				for (int imgX = tile.rect.x; imgX < tile.rect.x + tile.rect.width; imgX++) {
+					const auto lineColor = toColor8(lineRow[imgX - tile.rect.x]);
+					if (toGray(lineColor) == 0) {
+						dstRow[imgX] = 0;
+						continue;
+					}
+
+					const auto noise = noiseAt(imgX, imgY);
+					cv::Vec3b noisedColor;
+					for (int c = 0; c < 3; c++) {
+						noisedColor[c] = static_cast<uchar>((lineColor[c] + noise[c]) & 255);
+					}
+					dstRow[imgX] = toGray(noisedColor);
+				}
+			}
+		});
+	}
+
+	// cv::COLOR_BGR2GRAY for 8-bit pixels, with OpenCV's 14-bit fixed-point weights.
+	static uchar toGray(const cv::Vec3b& color) {
+		return static_cast<uchar>((color[0] * 1868 + color[1] * 9617 + color[2] * 4899 + (1 << 13)) >> 14);
+	}
+
+	// One Gaussian sample per channel, saturated to 8 bits as cv::randn does for CV_8U, by
+	// Box-Muller on the four words Philox gives for this pixel.
+	cv::Vec3b noiseAt(int imgX, int imgY) const {
+		const auto words = Philox4x32::generate(
+			{ static_cast<uint32_t>(imgX), static_cast<uint32_t>(imgY), static_cast<uint32_t>(frameIndex), static_cast<uint32_t>(frameIndex >> 32) },
+			{ static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32) });
+
+		// (word + 0.5) / 2^32 is in (0, 1), so the logarithm is finite.
+		auto uniform = [&](int i) {
+			return (words[i] + 0.5) * (1.0 / 4294967296.0);
+		};
+		const double radius0 = std::sqrt(-2.0 * std::log(uniform(0)));
+		const double angle0 = 2.0 * std::numbers::pi * uniform(1);
+		const double radius1 = std::sqrt(-2.0 * std::log(uniform(2)));
+		const double angle1 = 2.0 * std::numbers::pi * uniform(3);
+
+		return cv::Vec3b(
+			cv::saturate_cast<uchar>(noiseMean + noiseSigma * radius0 * std::cos(angle0)),
+			cv::saturate_cast<uchar>(noiseMean + noiseSigma * radius0 * std::sin(angle0)),
+			cv::saturate_cast<uchar>(noiseMean + noiseSigma * radius1 * std::cos(angle1)));
+	}
+};
@@ -0,0 +1,266 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <type_traits>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "PixelTypes.hpp"
+#include "Simd.hpp"
+#include "TileScheduler.hpp"
+
+// One bit per pixel, each row padded to whole 64-bit words.
+class PixelMask {
+public:
+	int cols = 0;
+	int rows = 0;
+	int wordsPerRow = 0;
+	std::vector<uint64_t> words;
+
+	PixelMask() {}
+
+	PixelMask(cv::Size size) : cols(size.width), rows(size.height), wordsPerRow((size.width + 63) / 64), words(static_cast<size_t>(wordsPerRow) * size.height, 0) {}
+
+	uint64_t* row(int imgY) {
+		return words.data() + static_cast<size_t>(imgY) * wordsPerRow;
+	}
+
+	const uint64_t* row(int imgY) const {
+		return words.data() + static_cast<size_t>(imgY) * wordsPerRow;
+	}
+
+	bool test(int imgX, int imgY) const {
+		return (row(imgY)[imgX / 64] >> (imgX % 64)) & 1;
+	}
+
+	// imgY * cols + imgX of every set pixel, in raster order.
+	std::vector<int> indices() const {
+		size_t count = 0;
+		for (const auto word : words) {
+			count += std::popcount(word);
+		}
+
+		std::vector<int> pixelIndices;
+		pixelIndices.reserve(count);
+		for (int imgY = 0; imgY < rows; imgY++) {
+			const auto rowWords = row(imgY);
+			for (int wordIdx = 0; wordIdx < wordsPerRow; wordIdx++) {
+				for (uint64_t word = rowWords[wordIdx]; word != 0; word &= word - 1) {
+					pixelIndices.push_back(imgY * cols + wordIdx * 64 + std::countr_zero(word));
+				}
+			}
+		}
+
+		return pixelIndices;
+	}
+};
+
+// Marks the pixels whose first 3 channels are all within colors[i][3] of colors[i], for any i.
+// 8-bit pixels are matched 16 at a time.
+template<typename T, typename U>
+class ColorMatcher {
+public:
+	ColorMatcher(const std::vector<cv::Vec<U, 4>>& _colors) : colors(_colors) {
+		if constexpr (std::is_same_v<U, uchar>) {
+			// A block of 16 pixels is `channels` vectors of 16 bytes. Each color becomes color and
+			// tolerance patterns laid out the same way, with channels past the third always matching.
+			patterns.resize(colors.size() * 2 * blockBytes);
+			for (size_t i = 0; i < colors.size(); i++) {
+				auto colorPattern = patterns.data() + i * 2 * blockBytes;
+				auto tolerancePattern = colorPattern + blockBytes;
+				for (int byteIdx = 0; byteIdx < blockBytes; byteIdx++) {
+					const int c = byteIdx % channels;
+					colorPattern[byteIdx] = c < 3 ? colors[i][c] : 0;
+					tolerancePattern[byteIdx] = c < 3 ? colors[i][3] : 255;
+				}
+			}
+		}
+	}
+
+	// Sets the bits of the matching pixels of the row; dstWords must be cleared beforehand.
+	void matchRow(const T* srcRow, int cols, uint64_t* dstWords) const {
+		int imgX = 0;
+
+		if constexpr (std::is_same_v<U, uchar>) {
+			auto srcBytes = reinterpret_cast<const uchar*>(srcRow);
+			for (; imgX + 16 <= cols; imgX += 16) {
+				// Bit pixel * channels is set where the pixel matches some color.
+				uint64_t matchBits = 0;
+				for (size_t i = 0; i < colors.size(); i++) {
+					const auto colorPattern = patterns.data() + i * 2 * blockBytes;
+					const auto tolerancePattern = colorPattern + blockBytes;
+
+					// Bit b is set where byte b of the block matches.
+					uint64_t byteBits = 0;
+					for (int v = 0; v < channels; v++) {
+						const auto bits = simd::matchU8x16(simd::loadU8x16(srcBytes + imgX * channels + v * 16), simd::loadU8x16(colorPattern + v * 16), simd::loadU8x16(tolerancePattern + v * 16));
+						byteBits |= static_cast<uint64_t>(static_cast<uint16_t>(bits)) << (v * 16);
+					}
+
+					uint64_t allBits = byteBits;
+					for (int c = 1; c < channels; c++) {
+						allBits &= byteBits >> c;
+					}
+					matchBits |= allBits;
+				}
+
+				dstWords[imgX / 64] |= static_cast<uint64_t>(simd::gatherBits<channels>(matchBits)) << (imgX % 64);
+			}
+		}
+
+		for (; imgX < cols; imgX++) {
+			const T srcColor = srcRow[imgX];
+			for (const auto& color : colors) {
+				if (std::abs(srcColor[0] - color[0]) <= color[3] &&
+					std::abs(srcColor[1] - color[1]) <= color[3] &&
+					std::abs(srcColor[2] - color[2]) <= color[3]) {
+					dstWords[imgX / 64] |= uint64_t(1) << (imgX % 64);
+					break;
+				}
+			}
+		}
+	}
+
+	PixelMask match(const cv::Mat_<T>& srcImg) const {
+		PixelMask mask(srcImg.size());
+		TileScheduler::rowBands().run(srcImg.size(), cv::Size(0, 0), [&](const Tile& tile) {
+			for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+				matchRow(srcImg.template ptr<T>(imgY), srcImg.cols, mask.row(imgY));
+			}
+		});
+		return mask;
+	}
+
+private:
+	static constexpr int channels = T::channels;
+	static constexpr int blockBytes = 16 * channels;
+
+	std::vector<cv::Vec<U, 4>> colors;
+	std::vector<uchar> patterns;
+};
+
+struct ColorRule {
+	cv::Vec3b color;
+	int tolerance; // per channel, inclusive
+	int classIndex; // 0 to 7
+};
+
+// Maps an 8-bit BGR color to the bitmask of the classes whose rules it matches. The rules are
+// compiled once into a 3-level table indexed by B, then G, then R: each level holds the offset of
+// the next level's 256 entries for the rules still possible, and rows of entries that keep the same
+// rules are shared, so the table stays a few KB and every pixel costs three dependent lookups.
+// Deeper pixels skip the table and test the rules at their own depth.
+class ColorClassifier {
+public:
+	ColorClassifier() : ColorClassifier(std::vector<ColorRule>()) {}
+
+	ColorClassifier(const std::vector<ColorRule>& _rules) : rules(_rules) {
+		CV_Assert(std::all_of(rules.begin(), rules.end(), [](const ColorRule& rule) { return 0 <= rule.classIndex && rule.classIndex < 8; }));
+
+		auto covers = [&](int ruleIdx, int channel, int value) {
+			return std::abs(value - rules[ruleIdx].color[channel]) <= rules[ruleIdx].tolerance;
+		};
+
+		std::vector<int> allRules(rules.size());
+		for (size_t i = 0; i < rules.size(); i++) {
+			allRules[i] = static_cast<int>(i);
+		}
+
+		// Entry value -> rules still matching after it; equal rule sets share the next level's row.
+		auto split = [&](const std::vector<int>& ruleIdxs, int channel, std::map<std::vector<int>, int>& rows, std::vector<std::vector<int>>& rowRules, int* dstEntries) {
+			for (int value = 0; value < 256; value++) {
+				std::vector<int> matching;
+				for (const auto ruleIdx : ruleIdxs) {
+					if (covers(ruleIdx, channel, value)) {
+						matching.push_back(ruleIdx);
+					}
+				}
+
+				auto found = rows.try_emplace(matching, static_cast<int>(rowRules.size()));
+				if (found.second) {
+					rowRules.push_back(matching);
+				}
+				dstEntries[value] = found.first->second * 256;
+			}
+		};
+
+		// Row 0 of every level is the empty rule set.
+		std::map<std::vector<int>, int> greenRows = { { {}, 0 } };
+		std::vector<std::vector<int>> greenRowRules = { {} };
+		split(allRules, 0, greenRows, greenRowRules, blues);
+
+		std::map<std::vector<int>, int> redRows = { { {}, 0 } };
+		std::vector<std::vector<int>> redRowRules = { {} };
+		greens.resize(greenRowRules.size() * 256);
+		for (size_t row = 0; row < greenRowRules.size(); row++) {
+			split(greenRowRules[row], 1, redRows, redRowRules, greens.data() + row * 256);
+		}
+
+		classes.assign(redRowRules.size() * 256, 0);
+		for (size_t row = 0; row < redRowRules.size(); row++) {
+			for (int value = 0; value < 256; value++) {
+				for (const auto ruleIdx : redRowRules[row]) {
+					if (covers(ruleIdx, 2, value)) {
+						classes[row * 256 + value] |= static_cast<uchar>(1 << rules[ruleIdx].classIndex);
+					}
+				}
+			}
+		}
+	}
+
+	// Channels past the third are ignored. For deeper samples a rule's color and tolerance are scaled
+	// from 8 bits, so 16-bit (4, 2, 10) with tolerance 0 matches only (1028, 514, 2570).
+	template<typename S, int cn>
+	uchar classify(const cv::Vec<S, cn>& color) const {
+		if constexpr (std::is_same_v<S, uchar>) {
+			return classes[greens[blues[color[0]] + color[1]] + color[2]];
+		}
+		else {
+			// Differences are in 8-bit steps; the slack absorbs float rounding of colors like 4 / 255.
+			constexpr double scale = 255.0 / whiteSample<S>();
+			constexpr double slack = 1e-4;
+
+			uchar classBits = 0;
+			for (const auto& rule : rules) {
+				bool isMatch = true;
+				for (int c = 0; c < 3; c++) {
+					isMatch = isMatch && std::abs(color[c] * scale - rule.color[c]) <= rule.tolerance + slack;
+				}
+				if (isMatch) {
+					classBits |= static_cast<uchar>(1 << rule.classIndex);
+				}
+			}
+			return classBits;
+		}
+	}
+
+	template<typename S, int cn>
+	void classifyRow(const cv::Vec<S, cn>* srcRow, uchar* dstRow, int cols) const {
+		for (int imgX = 0; imgX < cols; imgX++) {
+			dstRow[imgX] = classify(srcRow[imgX]);
+		}
+	}
+
+	// Class bitmask of every pixel of an image of any of the pixel types.
+	cv::Mat_<uchar> classify(const cv::Mat& img) const {
+		cv::Mat_<uchar> classImg = BufferPool::shared().acquire(img.size(), CV_8UC1);
+		dispatchPixelType(img.type(), [&]<typename T>(T) {
+			TileScheduler::rowBands().run(img.size(), cv::Size(0, 0), [&](const Tile& tile) {
+				for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+					classifyRow(img.ptr<T>(imgY), classImg.ptr<uchar>(imgY), img.cols);
+				}
+			});
+		});
+		return classImg;
+	}
+
+private:
+	std::vector<ColorRule> rules;
+	int blues[256];
+	std::vector<int> greens;
+	std::vector<uchar> classes;
+};
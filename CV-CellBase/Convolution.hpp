@@ -0,0 +1,431 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "Simd.hpp"
+
+// Row-pointer convolution of 8-bit, 16-bit and float images. Rows are handled as flat arrays of
+// cols * channels samples, so a tap at offset x of the kernel is simply x * channels samples further
+// along the row. Sums are float whatever the sample type.
+namespace convolution {
+
+inline void loadRow(const uchar* src, float* dst, int length) {
+	int i = 0;
+	for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+		simd::store(dst + i, simd::loadU8(src + i));
+	}
+	for (; i < length; i++) {
+		dst[i] = src[i];
+	}
+}
+
+inline void loadRow(const ushort* src, float* dst, int length) {
+	int i = 0;
+	for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+		simd::store(dst + i, simd::loadU16(src + i));
+	}
+	for (; i < length; i++) {
+		dst[i] = src[i];
+	}
+}
+
+inline void loadRow(const float* src, float* dst, int length) {
+	std::copy(src, src + length, dst);
+}
+
+inline void storeRow(const float* src, uchar* dst, int length) {
+	int i = 0;
+	for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+		simd::storeU8(dst + i, simd::load(src + i));
+	}
+	for (; i < length; i++) {
+		dst[i] = cv::saturate_cast<uchar>(src[i]);
+	}
+}
+
+inline void storeRow(const float* src, ushort* dst, int length) {
+	int i = 0;
+	for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+		simd::storeU16(dst + i, simd::load(src + i));
+	}
+	for (; i < length; i++) {
+		dst[i] = cv::saturate_cast<ushort>(src[i]);
+	}
+}
+
+inline void storeRow(const float* src, float* dst, int length) {
+	std::copy(src, src + length, dst);
+}
+
+// dst[i] += src[i] * weight
+inline void accumulateRow(const float* src, float* dst, int length, float weight) {
+	const auto w = simd::set1(weight);
+
+	int i = 0;
+	for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+		simd::store(dst + i, simd::add(simd::load(dst + i), simd::mul(simd::load(src + i), w)));
+	}
+	for (; i < length; i++) {
+		dst[i] += src[i] * weight;
+	}
+}
+
+// dst[i] = src1[i] * src2[i]
+inline void multiplyRow(const float* src1, const float* src2, float* dst, int length) {
+	int i = 0;
+	for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+		simd::store(dst + i, simd::mul(simd::load(src1 + i), simd::load(src2 + i)));
+	}
+	for (; i < length; i++) {
+		dst[i] = src1[i] * src2[i];
+	}
+}
+
+// dst[i] = sum of src[i + k * step] * weights[k]
+inline void convolveRow(const float* src, float* dst, int length, const std::vector<float>& weights, int step) {
+	const int taps = static_cast<int>(weights.size());
+
+	int i = 0;
+	for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+		auto acc = simd::zero();
+		for (int k = 0; k < taps; k++) {
+			acc = simd::add(acc, simd::mul(simd::load(src + i + k * step), simd::set1(weights[k])));
+		}
+		simd::store(dst + i, acc);
+	}
+	for (; i < length; i++) {
+		float acc = 0.0f;
+		for (int k = 0; k < taps; k++) {
+			acc += src[i + k * step] * weights[k];
+		}
+		dst[i] = acc;
+	}
+}
+
+// Horizontal pass into a ring of float rows, then a vertical pass over those rows.
+// paddedImg holds the source of dstImg with kernel size / 2 extra pixels on the top and left and
+// enough on the bottom and right to cover the rest of the kernel. S is the sample type of both.
+template<typename S>
+inline void separableFilter(const cv::Mat& paddedImg, cv::Mat dstImg, const std::vector<float>& rowKernel, const std::vector<float>& colKernel) {
+	const int channels = paddedImg.channels();
+	const int kernelHeight = static_cast<int>(colKernel.size());
+
+	const int length = dstImg.cols * channels;
+	const int paddedLength = paddedImg.cols * channels;
+
+	std::vector<float> srcRow(paddedLength);
+	std::vector<float> dstRow(length);
+	std::vector<float> tmpRows(static_cast<size_t>(kernelHeight) * length);
+	std::vector<int> tmpRowIndices(kernelHeight, -1);
+
+	for (int imgY = 0; imgY < dstImg.rows; imgY++) {
+		std::fill(dstRow.begin(), dstRow.end(), 0.0f);
+
+		for (int kernelY = 0; kernelY < kernelHeight; kernelY++) {
+			const int paddedY = imgY + kernelY;
+			const int slot = paddedY % kernelHeight;
+			float* tmpRow = tmpRows.data() + static_cast<size_t>(slot) * length;
+
+			if (tmpRowIndices[slot] != paddedY) {
+				loadRow(paddedImg.ptr<S>(paddedY), srcRow.data(), paddedLength);
+				convolveRow(srcRow.data(), tmpRow, length, rowKernel, channels);
+				tmpRowIndices[slot] = paddedY;
+			}
+
+			accumulateRow(tmpRow, dstRow.data(), length, colKernel[kernelY]);
+		}
+
+		storeRow(dstRow.data(), dstImg.ptr<S>(imgY), length);
+	}
+}
+
+// Full 2D kernel over a padded source (see separableFilter). Taps are accumulated in the same
+// row-major order as a per-pixel loop, so results are bit-identical to it.
+template<typename S>
+inline void filter2D(const cv::Mat& paddedImg, cv::Mat dstImg, const cv::Mat_<float>& kernel) {
+	const int channels = paddedImg.channels();
+
+	const int length = dstImg.cols * channels;
+	const int paddedLength = paddedImg.cols * channels;
+
+	std::vector<float> dstRow(length);
+	std::vector<float> srcRows(static_cast<size_t>(kernel.rows) * paddedLength);
+	std::vector<int> srcRowIndices(kernel.rows, -1);
+
+	for (int imgY = 0; imgY < dstImg.rows; imgY++) {
+		std::fill(dstRow.begin(), dstRow.end(), 0.0f);
+
+		for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
+			const int paddedY = imgY + kernelY;
+			const int slot = paddedY % kernel.rows;
+			float* srcRow = srcRows.data() + static_cast<size_t>(slot) * paddedLength;
+
+			if (srcRowIndices[slot] != paddedY) {
+				loadRow(paddedImg.ptr<S>(paddedY), srcRow, paddedLength);
+				srcRowIndices[slot] = paddedY;
+			}
+
+			for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
+				accumulateRow(srcRow + kernelX * channels, dstRow.data(), length, kernel(kernelY, kernelX));
+			}
+		}
+
+		storeRow(dstRow.data(), dstImg.ptr<S>(imgY), length);
+	}
+}
+
+// Calls fn(std::integral_constant<int, k>()) for k = 0 .. N - 1, unrolled.
+template<int N, typename Fn>
+inline void unroll(Fn&& fn) {
+	[&]<int... k>(std::integer_sequence<int, k...>) {
+		(fn(std::integral_constant<int, k>()), ...);
+	}(std::make_integer_sequence<int, N>());
+}
+
+// separableFilter for a FixedKernel: the taps are unrolled, zero weights are skipped and each
+// chunk is summed in a register. The sums are in the same order, so results are the same.
+template<auto Kernel, typename S>
+inline void fixedSeparableFilter(const cv::Mat& paddedImg, cv::Mat dstImg) {
+	static_assert(Kernel.isSeparable);
+	constexpr int kernelWidth = Kernel.width;
+	constexpr int kernelHeight = Kernel.height;
+	const int channels = paddedImg.channels();
+
+	const int length = dstImg.cols * channels;
+	const int paddedLength = paddedImg.cols * channels;
+
+	std::vector<float> srcRow(paddedLength);
+	std::vector<float> dstRow(length);
+	std::vector<float> tmpRows(static_cast<size_t>(kernelHeight) * length);
+	std::vector<int> tmpRowIndices(kernelHeight, -1);
+
+	auto convolveRow = [&](const float* src, float* dst) {
+		int i = 0;
+		for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+			auto acc = simd::zero();
+			unroll<kernelWidth>([&](auto k) {
+				if constexpr (Kernel.row[decltype(k)::value] != 0.0f) {
+					acc = simd::add(acc, simd::mul(simd::load(src + i + k * channels), simd::set1(Kernel.row[decltype(k)::value])));
+				}
+			});
+			simd::store(dst + i, acc);
+		}
+		for (; i < length; i++) {
+			float acc = 0.0f;
+			unroll<kernelWidth>([&](auto k) {
+				if constexpr (Kernel.row[decltype(k)::value] != 0.0f) {
+					acc += src[i + k * channels] * Kernel.row[decltype(k)::value];
+				}
+			});
+			dst[i] = acc;
+		}
+	};
+
+	const float* tmpRowPtrs[kernelHeight];
+	for (int imgY = 0; imgY < dstImg.rows; imgY++) {
+		for (int kernelY = 0; kernelY < kernelHeight; kernelY++) {
+			const int paddedY = imgY + kernelY;
+			const int slot = paddedY % kernelHeight;
+			float* tmpRow = tmpRows.data() + static_cast<size_t>(slot) * length;
+
+			if (tmpRowIndices[slot] != paddedY) {
+				loadRow(paddedImg.ptr<S>(paddedY), srcRow.data(), paddedLength);
+				convolveRow(srcRow.data(), tmpRow);
+				tmpRowIndices[slot] = paddedY;
+			}
+			tmpRowPtrs[kernelY] = tmpRow;
+		}
+
+		int i = 0;
+		for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+			auto acc = simd::zero();
+			unroll<kernelHeight>([&](auto k) {
+				if constexpr (Kernel.col[decltype(k)::value] != 0.0f) {
+					acc = simd::add(acc, simd::mul(simd::load(tmpRowPtrs[k] + i), simd::set1(Kernel.col[decltype(k)::value])));
+				}
+			});
+			simd::store(dstRow.data() + i, acc);
+		}
+		for (; i < length; i++) {
+			float acc = 0.0f;
+			unroll<kernelHeight>([&](auto k) {
+				if constexpr (Kernel.col[decltype(k)::value] != 0.0f) {
+					acc += tmpRowPtrs[k][i] * Kernel.col[decltype(k)::value];
+				}
+			});
+			dstRow[i] = acc;
+		}
+
+		storeRow(dstRow.data(), dstImg.ptr<S>(imgY), length);
+	}
+}
+
+// filter2D for a FixedKernel, unrolled in the same row-major order, zero weights skipped.
+template<auto Kernel, typename S>
+inline void fixedFilter2D(const cv::Mat& paddedImg, cv::Mat dstImg) {
+	constexpr int kernelWidth = Kernel.width;
+	constexpr int kernelHeight = Kernel.height;
+	const int channels = paddedImg.channels();
+
+	const int length = dstImg.cols * channels;
+	const int paddedLength = paddedImg.cols * channels;
+
+	std::vector<float> dstRow(length);
+	std::vector<float> srcRows(static_cast<size_t>(kernelHeight) * paddedLength);
+	std::vector<int> srcRowIndices(kernelHeight, -1);
+
+	const float* srcRowPtrs[kernelHeight];
+	for (int imgY = 0; imgY < dstImg.rows; imgY++) {
+		for (int kernelY = 0; kernelY < kernelHeight; kernelY++) {
+			const int paddedY = imgY + kernelY;
+			const int slot = paddedY % kernelHeight;
+			float* srcRow = srcRows.data() + static_cast<size_t>(slot) * paddedLength;
+
+			if (srcRowIndices[slot] != paddedY) {
+				loadRow(paddedImg.ptr<S>(paddedY), srcRow, paddedLength);
+				srcRowIndices[slot] = paddedY;
+			}
+			srcRowPtrs[kernelY] = srcRow;
+		}
+
+		int i = 0;
+		for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+			auto acc = simd::zero();
+			unroll<kernelWidth * kernelHeight>([&](auto k) {
+				constexpr int kernelY = decltype(k)::value / kernelWidth;
+				constexpr int kernelX = decltype(k)::value % kernelWidth;
+				if constexpr (Kernel(kernelY, kernelX) != 0.0f) {
+					acc = simd::add(acc, simd::mul(simd::load(srcRowPtrs[kernelY] + i + kernelX * channels), simd::set1(Kernel(kernelY, kernelX))));
+				}
+			});
+			simd::store(dstRow.data() + i, acc);
+		}
+		for (; i < length; i++) {
+			float acc = 0.0f;
+			unroll<kernelWidth * kernelHeight>([&](auto k) {
+				constexpr int kernelY = decltype(k)::value / kernelWidth;
+				constexpr int kernelX = decltype(k)::value % kernelWidth;
+				if constexpr (Kernel(kernelY, kernelX) != 0.0f) {
+					acc += srcRowPtrs[kernelY][i + kernelX * channels] * Kernel(kernelY, kernelX);
+				}
+			});
+			dstRow[i] = acc;
+		}
+
+		storeRow(dstRow.data(), dstImg.ptr<S>(imgY), length);
+	}
+}
+
+// Sliding-window horizontal sum: dst[i] = sum of src[i + k * step] for k in [0, taps).
+inline void boxSumRow(const uchar* src, int32_t* dst, int length, int taps, int step) {
+	const int head = std::min(step, length);
+	for (int i = 0; i < head; i++) {
+		int32_t sum = 0;
+		for (int k = 0; k < taps; k++) {
+			sum += src[i + k * step];
+		}
+		dst[i] = sum;
+	}
+	for (int i = head; i < length; i++) {
+		dst[i] = dst[i - step] + src[i - step + taps * step] - src[i - step];
+	}
+}
+
+// Averaging filter whose cost per pixel does not depend on the window size. paddedImg is laid out
+// as for separableFilter, which anchors the window like the kernel of AveragingBlur.
+// 8-bit only: the integer window sums of deeper samples could overflow.
+inline void boxFilter(const cv::Mat& paddedImg, cv::Mat dstImg, int kernelWidth, int kernelHeight) {
+	const int channels = paddedImg.channels();
+	const int length = dstImg.cols * channels;
+	const float scale = 1.0f / (kernelWidth * kernelHeight);
+
+	std::vector<int32_t> colSum(length, 0);
+	std::vector<int32_t> enterRow(length);
+	std::vector<int32_t> leaveRow(length);
+
+	for (int kernelY = 0; kernelY < kernelHeight - 1; kernelY++) {
+		boxSumRow(paddedImg.ptr<uchar>(kernelY), enterRow.data(), length, kernelWidth, channels);
+		for (int i = 0; i < length; i++) {
+			colSum[i] += enterRow[i];
+		}
+	}
+
+	for (int imgY = 0; imgY < dstImg.rows; imgY++) {
+		boxSumRow(paddedImg.ptr<uchar>(imgY + kernelHeight - 1), enterRow.data(), length, kernelWidth, channels);
+		for (int i = 0; i < length; i++) {
+			colSum[i] += enterRow[i];
+		}
+
+		auto dstRow = dstImg.ptr<uchar>(imgY);
+		const auto w = simd::set1(scale);
+		int i = 0;
+		for (; i + simd::f32::lanes <= length; i += simd::f32::lanes) {
+			simd::storeU8(dstRow + i, simd::mul(simd::loadI32(colSum.data() + i), w));
+		}
+		for (; i < length; i++) {
+			dstRow[i] = cv::saturate_cast<uchar>(colSum[i] * scale);
+		}
+
+		boxSumRow(paddedImg.ptr<uchar>(imgY), leaveRow.data(), length, kernelWidth, channels);
+		for (int i = 0; i < length; i++) {
+			colSum[i] -= leaveRow[i];
+		}
+	}
+}
+
+// max(|SobelX|, |SobelY|) for one row, computed in int16 from the three padded source rows around it.
+// Sobel weights are small integers, so the result is exact and saturates straight to uint8.
+inline void sobelAbsXYRow(const uchar* row0, const uchar* row1, const uchar* row2, uchar* dst, int length, int step) {
+	int i = 0;
+	for (; i + simd::i16::lanes <= length; i += simd::i16::lanes) {
+		const auto topLeft = simd::loadU8AsI16(row0 + i);
+		const auto top = simd::loadU8AsI16(row0 + i + step);
+		const auto topRight = simd::loadU8AsI16(row0 + i + 2 * step);
+		const auto left = simd::loadU8AsI16(row1 + i);
+		const auto right = simd::loadU8AsI16(row1 + i + 2 * step);
+		const auto bottomLeft = simd::loadU8AsI16(row2 + i);
+		const auto bottom = simd::loadU8AsI16(row2 + i + step);
+		const auto bottomRight = simd::loadU8AsI16(row2 + i + 2 * step);
+
+		const auto middleX = simd::sub(left, right);
+		const auto gradX = simd::add(simd::add(simd::sub(topLeft, topRight), simd::sub(bottomLeft, bottomRight)), simd::add(middleX, middleX));
+
+		const auto middleY = simd::sub(top, bottom);
+		const auto gradY = simd::add(simd::add(simd::sub(topLeft, bottomLeft), simd::sub(topRight, bottomRight)), simd::add(middleY, middleY));
+
+		simd::storeU8(dst + i, simd::max(simd::abs(gradX), simd::abs(gradY)));
+	}
+	for (; i < length; i++) {
+		const int gradX = (row0[i] - row0[i + 2 * step]) + 2 * (row1[i] - row1[i + 2 * step]) + (row2[i] - row2[i + 2 * step]);
+		const int gradY = (row0[i] + 2 * row0[i + step] + row0[i + 2 * step]) - (row2[i] + 2 * row2[i + step] + row2[i + 2 * step]);
+		dst[i] = cv::saturate_cast<uchar>(std::max(std::abs(gradX), std::abs(gradY)));
+	}
+}
+
+// Same for 16-bit and float samples, in int or float.
+template<typename S>
+inline void sobelAbsXYRow(const S* row0, const S* row1, const S* row2, S* dst, int length, int step) {
+	using Acc = std::conditional_t<std::is_floating_point_v<S>, float, int>;
+
+	for (int i = 0; i < length; i++) {
+		const Acc gradX = (Acc(row0[i]) - row0[i + 2 * step]) + 2 * (Acc(row1[i]) - row1[i + 2 * step]) + (Acc(row2[i]) - row2[i + 2 * step]);
+		const Acc gradY = (Acc(row0[i]) + 2 * Acc(row0[i + step]) + row0[i + 2 * step]) - (Acc(row2[i]) + 2 * Acc(row2[i + step]) + row2[i + 2 * step]);
+		dst[i] = cv::saturate_cast<S>(std::max(std::abs(gradX), std::abs(gradY)));
+	}
+}
+
+// paddedImg holds the source of dstImg with one extra pixel on every side.
+template<typename S>
+inline void sobelAbsXY(const cv::Mat& paddedImg, cv::Mat dstImg) {
+	const int length = dstImg.cols * paddedImg.channels();
+
+	for (int imgY = 0; imgY < dstImg.rows; imgY++) {
+		sobelAbsXYRow(paddedImg.ptr<S>(imgY), paddedImg.ptr<S>(imgY + 1), paddedImg.ptr<S>(imgY + 2), dstImg.ptr<S>(imgY), length, paddedImg.channels());
+	}
+}
+}
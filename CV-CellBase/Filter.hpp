@@ -1,153 +1,274 @@
 #pragma once
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <numbers>
 #include <span>
 #include <filesystem>
+#include <mutex>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
 
 #include <opencv2/opencv.hpp>
 
-template<typename T, typename int N>
-inline cv::Vec<T, N> abs(cv::Vec<T, N> src) {
-	cv::Vec<T, N> dst;
+#include "BufferPool.hpp"
+#include "ColorMatch.hpp"
+#include "Convolution.hpp"
+#include "FixedKernel.hpp"
+#include "PixelTypes.hpp"
+#include "Simd.hpp"
+#include "TileScheduler.hpp"
+#include "Trace.hpp"
 
-	for (int i = 0; i < N; i++) {
-		dst[i] = abs(src[i]);
-	}
+class Filter {
+public:
+	TileScheduler scheduler;
 
-	return dst;
-}
+	virtual cv::Mat apply(cv::Mat srcImg) = 0;
 
-template<typename T, typename int N>
-inline cv::Vec<T, N> max(cv::Vec<T, N> src1, cv::Vec<T, N> src2) {
-	cv::Vec<T, N> dst;
+	// How far (in pixels) an output pixel reaches into the source around it.
+	virtual cv::Size halo() const {
+		return cv::Size(0, 0);
+	}
 
-	for (int i = 0; i < N; i++) {
-		dst[i] = std::max(src1[i], src2[i]);
+	// True when every output pixel depends only on the source within halo(), with the image
+	// border handled by replicating edge pixels. Such filters give the same result on a crop.
+	virtual bool isLocal() const {
+		return false;
 	}
 
-	return dst;
-}
+	// Identifies what the filter computes: filters with the same non-empty signature give the same
+	// output for the same input. An empty signature means the filter is never shared.
+	virtual std::string signature() const {
+		return "";
+	}
 
-class Filter {
-public:
-	virtual cv::Mat apply(cv::Mat srcImg) = 0;
+	// True when the output also depends on the index of the frame being processed, which
+	// setFrameIndex passes in before each frame. Such output is never reused from another frame.
+	virtual bool isFrameDependent() const {
+		return false;
+	}
 
+	virtual void setFrameIndex(uint64_t) {}
 };
 
 class LinearFilter :public Filter {
 public:
 	cv::Mat_<float> kernel;
+	std::vector<float> rowKernel;
+	std::vector<float> colKernel;
+
+	// The separable path weights and sums the samples in a different order than the 2D loop, so 8-
+	// and 16-bit results may differ from the 2D convolution by one code value (GaussianBlur(20, 21)
+	// does on some pixels). Set to false where output has to match it exactly.
+	bool useSeparable = true;
 
 protected:
 	LinearFilter(int kernel_width, int kernel_height) {
 		kernel = cv::Mat_<float>(kernel_height, kernel_width);
 	}
 
-public:
-	cv::Mat apply(cv::Mat srcImg) {
-		auto dstImg = cv::Mat(srcImg.size(), srcImg.type());
+	void setSeparableKernel(const std::vector<float>& _rowKernel, const std::vector<float>& _colKernel) {
+		rowKernel = _rowKernel;
+		colKernel = _colKernel;
 
-		const int kernelCenterY = kernel.rows / 2;
-		const int kernelCenterX = kernel.cols / 2;
+		for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
+			for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
+				kernel(kernelY, kernelX) = colKernel[kernelY] * rowKernel[kernelX];
+			}
+		}
+	}
 
-		for (int imgY = 0; imgY < srcImg.rows; imgY++) {
-			for (int imgX = 0; imgX < srcImg.cols; imgX++) {
-				cv::Vec3f dstImgPixel(0, 0, 0);
+	// Factors a rank-1 kernel into kernel(y, x) == _colKernel[y] * _rowKernel[x].
+	bool separateKernel(std::vector<float>& _rowKernel, std::vector<float>& _colKernel) const {
+		int pivotY = 0;
+		int pivotX = 0;
+		for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
+			for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
+				if (std::abs(kernel(kernelY, kernelX)) > std::abs(kernel(pivotY, pivotX))) {
+					pivotY = kernelY;
+					pivotX = kernelX;
+				}
+			}
+		}
 
-				for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
-					for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
-						auto imgSampleY = std::clamp(imgY + kernelY - kernelCenterY, 0, srcImg.rows - 1);
-						auto imgSampleX = std::clamp(imgX + kernelX - kernelCenterX, 0, srcImg.cols - 1);
-						auto srcImgPixel = srcImg.at<cv::Vec3b>(imgSampleY, imgSampleX);
+		const float pivot = kernel(pivotY, pivotX);
+		if (pivot == 0.0f) {
+			return false;
+		}
 
-						auto weight = kernel(kernelY, kernelX);
-						dstImgPixel += static_cast<cv::Vec3f>(srcImgPixel) * weight;
-					}
-				}
+		_rowKernel.resize(kernel.cols);
+		_colKernel.resize(kernel.rows);
+		for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
+			_rowKernel[kernelX] = kernel(pivotY, kernelX) / pivot;
+		}
+		for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
+			_colKernel[kernelY] = kernel(kernelY, pivotX);
+		}
 
-				dstImg.at<cv::Vec3b>(imgY, imgX) = dstImgPixel;
+		const float tolerance = std::abs(pivot) * 1e-6f;
+		for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
+			for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
+				if (std::abs(kernel(kernelY, kernelX) - _colKernel[kernelY] * _rowKernel[kernelX]) > tolerance) {
+					return false;
+				}
 			}
 		}
 
+		return true;
+	}
+
+	cv::Mat applySeparable(const cv::Mat& srcImg, const std::vector<float>& _rowKernel, const std::vector<float>& _colKernel) {
+		auto dstImg = BufferPool::shared().acquire(srcImg.size(), srcImg.type());
+		dispatchPixelType(srcImg.type(), [&]<typename T>(T) {
+			scheduler.run(srcImg.size(), halo(), [&](const Tile& tile) {
+				convolution::separableFilter<typename T::value_type>(tile.pad(srcImg), dstImg(tile.rect), _rowKernel, _colKernel);
+			});
+		});
+		return dstImg;
+	}
+
+	cv::Mat applyKernel(const cv::Mat& srcImg) {
+		auto dstImg = BufferPool::shared().acquire(srcImg.size(), srcImg.type());
+		dispatchPixelType(srcImg.type(), [&]<typename T>(T) {
+			scheduler.run(srcImg.size(), halo(), [&](const Tile& tile) {
+				convolution::filter2D<typename T::value_type>(tile.pad(srcImg), dstImg(tile.rect), kernel);
+			});
+		});
 		return dstImg;
 	}
-};
 
-class AveragingBlur : public LinearFilter {
 public:
-	AveragingBlur(int kernel_width, int kernel_height) : LinearFilter(kernel_width, kernel_height) {
-		float weight = 1.0f / (kernel_width * kernel_height);
+	cv::Size halo() const {
+		return cv::Size(kernel.cols / 2, kernel.rows / 2);
+	}
+
+	bool isLocal() const {
+		return true;
+	}
 
+	// Subclasses may compute the same kernel differently (AveragingBlur), so the class is part of it.
+	std::string signature() const {
+		std::ostringstream stream;
+		stream << typeid(*this).name() << "(" << kernel.cols << "x" << kernel.rows << std::setprecision(9);
 		for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
 			for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
-				kernel(kernelY, kernelX) = weight;
+				stream << "," << kernel(kernelY, kernelX);
 			}
 		}
+		stream << (useSeparable ? "" : ",2D") << ")";
+		return stream.str();
 	}
-};
 
-class SobelX : public LinearFilter {
-public:
-	SobelX() : LinearFilter(3, 3) {
-		float weights[3][3] = { {1, 0, -1},
-								{2, 0, -2},
-								{1, 0, -1} };
+	cv::Mat apply(cv::Mat srcImg) {
+		if (!useSeparable) {
+			return applyKernel(srcImg);
+		}
 
-		for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
-			for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
-				kernel(kernelY, kernelX) = weights[kernelY][kernelX];
-			}
+		if (!rowKernel.empty() && !colKernel.empty()) {
+			return applySeparable(srcImg, rowKernel, colKernel);
 		}
+
+		std::vector<float> _rowKernel, _colKernel;
+		if (separateKernel(_rowKernel, _colKernel)) {
+			return applySeparable(srcImg, _rowKernel, _colKernel);
+		}
+
+		return applyKernel(srcImg);
 	}
 };
 
-class SobelY : public LinearFilter {
+// LinearFilter with a kernel fixed at compile time, convolved by fully unrolled loops that skip its
+// zero weights. Gives the same results as LinearFilter with the same kernel.
+template<auto Kernel>
+class FixedLinearFilter : public LinearFilter {
 public:
-	SobelY() : LinearFilter(3, 3) {
-		float weights[3][3] = { {1, 2, 1},
-								{0, 0, 0},
-								{-1, -2, -1} };
-
+	FixedLinearFilter() : LinearFilter(Kernel.width, Kernel.height) {
 		for (int kernelY = 0; kernelY < kernel.rows; kernelY++) {
 			for (int kernelX = 0; kernelX < kernel.cols; kernelX++) {
-				kernel(kernelY, kernelX) = weights[kernelY][kernelX];
+				kernel(kernelY, kernelX) = Kernel(kernelY, kernelX);
 			}
 		}
+
+		if constexpr (Kernel.isSeparable) {
+			rowKernel.assign(Kernel.row.begin(), Kernel.row.end());
+			colKernel.assign(Kernel.col.begin(), Kernel.col.end());
+		}
 	}
-};
 
-class SobelAbsXY :public Filter {
-private:
-	cv::Mat_<float> sobelX = SobelX().kernel;
-	cv::Mat_<float> sobelY = SobelY().kernel;
+	cv::Mat apply(cv::Mat srcImg) {
+		if (Kernel.isSeparable && !useSeparable) {
+			return applyKernel(srcImg);
+		}
 
+		auto dstImg = BufferPool::shared().acquire(srcImg.size(), srcImg.type());
+		dispatchPixelType(srcImg.type(), [&]<typename T>(T) {
+			scheduler.run(srcImg.size(), halo(), [&](const Tile& tile) {
+				if constexpr (Kernel.isSeparable) {
+					convolution::fixedSeparableFilter<Kernel, typename T::value_type>(tile.pad(srcImg), dstImg(tile.rect));
+				}
+				else {
+					convolution::fixedFilter2D<Kernel, typename T::value_type>(tile.pad(srcImg), dstImg(tile.rect));
+				}
+			});
+		});
+		return dstImg;
+	}
+};
+
+class AveragingBlur : public LinearFilter {
 public:
+	AveragingBlur(int kernel_width, int kernel_height) : LinearFilter(kernel_width, kernel_height) {
+		setSeparableKernel(
+			std::vector<float>(kernel_width, 1.0f / kernel_width),
+			std::vector<float>(kernel_height, 1.0f / kernel_height));
+	}
+
 	cv::Mat apply(cv::Mat srcImg) {
-		auto dstImg = cv::Mat(srcImg.size(), srcImg.type());
+		if (srcImg.depth() != CV_8U || !useSeparable) {
+			return LinearFilter::apply(srcImg);
+		}
+
+		auto dstImg = BufferPool::shared().acquire(srcImg.size(), srcImg.type());
+		scheduler.run(srcImg.size(), halo(), [&](const Tile& tile) {
+			convolution::boxFilter(tile.pad(srcImg), dstImg(tile.rect), kernel.cols, kernel.rows);
+		});
+		return dstImg;
+	}
+};
+
+class SobelX : public FixedLinearFilter<fixedKernels::sobelX()> {
+};
 
-		const int kernelCenterY = sobelX.rows / 2;
-		const int kernelCenterX = sobelX.cols / 2;
+class SobelY : public FixedLinearFilter<fixedKernels::sobelY()> {
+};
 
-		for (int imgY = 1; imgY < srcImg.rows - 1; imgY++) {
-			for (int imgX = 1; imgX < srcImg.cols - 1; imgX++) {
-				cv::Vec3f dstImgPixelX(0, 0, 0), dstImgPixelY(0, 0, 0);
-				for (int kernelY = 0; kernelY < sobelX.rows; kernelY++) {
-					for (int kernelX = 0; kernelX < sobelX.cols; kernelX++) {
-						auto imgSampleY = imgY + kernelY - kernelCenterY;
-						auto imgSampleX = imgX + kernelX - kernelCenterX;
-						auto srcImgPixel = srcImg.at<cv::Vec3b>(imgSampleY, imgSampleX);
+class SobelAbsXY :public Filter {
+public:
+	cv::Size halo() const {
+		return cv::Size(1, 1);
+	}
 
-						auto weightX = sobelX(kernelY, kernelX);
-						auto weightY = sobelY(kernelY, kernelX);
+	bool isLocal() const {
+		return true;
+	}
 
-						dstImgPixelX += static_cast<cv::Vec3f>(srcImgPixel) * weightX;
-						dstImgPixelY += static_cast<cv::Vec3f>(srcImgPixel) * weightY;
-					}
-				}
-				dstImg.at<cv::Vec3b>(imgY, imgX) = max(abs(dstImgPixelX), abs(dstImgPixelY));
-			}
-		}
+	std::string signature() const {
+		return "SobelAbsXY";
+	}
 
+	cv::Mat apply(cv::Mat srcImg) {
+		auto dstImg = BufferPool::shared().acquire(srcImg.size(), srcImg.type());
+		dispatchPixelType(srcImg.type(), [&]<typename T>(T) {
+			scheduler.run(srcImg.size(), halo(), [&](const Tile& tile) {
+				convolution::sobelAbsXY<typename T::value_type>(tile.pad(srcImg), dstImg(tile.rect));
+			});
+		});
 		return dstImg;
 	}
 };
@@ -155,11 +276,29 @@ public:
 class GaussianBlur : public LinearFilter {
 public:
 	GaussianBlur(float sigma, int size) : LinearFilter(size, size) {
-		constexpr float pi = static_cast<float>(std::numbers::pi);
-
+		// exp(-(x^2 + y^2) / 2s^2) == exp(-x^2 / 2s^2) * exp(-y^2 / 2s^2), so the normalized 2D kernel is the outer product of one normalized 1D kernel.
+		std::vector<float> weights;
 		float gauss_total = 0.0f;
 		int center = size / 2;
 
+		for (int i = 0; i < size; i++) {
+			int length = center - i;
+			float weight = exp(-static_cast<float>(length * length) / (2 * sigma * sigma));
+
+			weights.push_back(weight);
+			gauss_total += weight;
+		}
+
+		for (int i = 0; i < size; i++) {
+			weights[i] /= gauss_total;
+		}
+
+		setSeparableKernel(weights, weights);
+
+		// The 2D kernel is built as the original 2D loop built it, so with useSeparable off the output
+		// is the same as before the separable path existed.
+		constexpr float pi = static_cast<float>(std::numbers::pi);
+		float gauss_total2D = 0.0f;
 		for (int kernelY = 0; kernelY < size; kernelY++) {
 			for (int kernelX = 0; kernelX < size; kernelX++) {
 				int lengthY = center - kernelY;
@@ -167,34 +306,71 @@ public:
 
 				float part1 = 1 / (2 * pi * sigma * sigma);
 				float part2 = exp(-(lengthX * lengthX + lengthY * lengthY) / (2 * sigma * sigma));
-				float weight = part1 * part2;
-
-				kernel(kernelY, kernelX) = weight;
-				gauss_total += weight;
+				kernel(kernelY, kernelX) = part1 * part2;
+				gauss_total2D += part1 * part2;
 			}
 		}
-
 		for (int kernelY = 0; kernelY < size; kernelY++) {
 			for (int kernelX = 0; kernelX < size; kernelX++) {
-				kernel(kernelY, kernelX) /= gauss_total;
+				kernel(kernelY, kernelX) /= gauss_total2D;
 			}
 		}
 	}
 };
 
+// GaussianBlur(Sigma, Size) with the kernel computed at compile time.
+template<int Size, float Sigma>
+using FixedGaussianBlur = FixedLinearFilter<fixedKernels::gaussian<Size>(Sigma)>;
+
+// AveragingBlur's kernel, applied by convolution for every depth: cheaper than the running sums of
+// AveragingBlur for small sizes, but 8-bit results may be rounded differently.
+template<int W, int H>
+using FixedAveragingBlur = FixedLinearFilter<fixedKernels::box<W, H>()>;
+
+// Marks the pure white pixels of a row, the background of the layers.
+template<typename T>
+void whiteRow(const T* srcRow, uchar* dstRow, int cols) {
+	for (int imgX = 0; imgX < cols; imgX++) {
+		dstRow[imgX] = isWhite(srcRow[imgX]);
+	}
+}
+
 class LineOnly : public Filter {
+	ColorClassifier lineClassifier;
+
+public:
+	LineOnly() : lineClassifier({ { cv::Vec3b(4, 2, 10), 0, 0 } }) {}
+
+private:
+	bool isLocal() const {
+		return true;
+	}
+
+	std::string signature() const {
+		return "LineOnly";
+	}
+
+	// Line pixels are matched at their own depth (see ColorClassifier::classify) and copied as they are.
 	cv::Mat apply(cv::Mat srcImg) {
-		auto dstImg = cv::Mat(srcImg.size(), srcImg.type());
-		for (int imgY = 1; imgY < srcImg.rows - 1; imgY++) {
-			for (int imgX = 1; imgX < srcImg.cols - 1; imgX++) {
-				if (srcImg.at<cv::Vec3b>(imgY, imgX) == cv::Vec3b(4, 2, 10)) {
-					dstImg.at<cv::Vec3b>(imgY, imgX) = cv::Vec3b(4, 2, 10);
-				}
-				else {
-					dstImg.at<cv::Vec3b>(imgY, imgX) = cv::Vec3b(255, 255, 255);
+		auto dstImg = BufferPool::shared().acquire(srcImg.size(), srcImg.type());
+		dispatchPixelType(srcImg.type(), [&]<typename T>(T) {
+			scheduler.run(srcImg.size(), halo(), [&](const Tile& tile) {
+				std::vector<uchar> lineRow(tile.rect.width);
+				for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+					auto srcRow = srcImg.ptr<T>(imgY);
+					auto dstRow = dstImg.ptr<T>(imgY);
+					lineClassifier.classifyRow(srcRow + tile.rect.x, lineRow.data(), tile.rect.width);
+					for (int imgX = tile.rect.x; imgX < tile.rect.x + tile.rect.width; imgX++) {
+						if (lineRow[imgX - tile.rect.x]) {
+							dstRow[imgX] = srcRow[imgX];
+						}
+						else {
+							dstRow[imgX] = whitePixel<T>();
+						}
+					}
 				}
-			}
-		}
+			});
+		});
 		return dstImg;
 	}
 
@@ -206,196 +382,407 @@ public:
 
 	Choke(int _chokeMatte1) : chokeMatte1(_chokeMatte1) {}
 
+	cv::Size halo() const {
+		return cv::Size(chokeMatte1 / 2, chokeMatte1 / 2);
+	}
+
+	bool isLocal() const {
+		return true;
+	}
+
+	std::string signature() const {
+		return "Choke(" + std::to_string(chokeMatte1) + ")";
+	}
+
 private:
-	cv::Mat applyChokeY(cv::Mat img, int chokeMatte) {
-		auto dstImg = cv::Mat(img.size(), img.type());
-
-		for (int imgX = 0; imgX < img.cols - 1; imgX++) {
-			for (int imgY = 0; imgY < img.rows - 1; imgY++) {
-
-				int altered = 0;
-				if (img.at<cv::Vec3b>(imgY, imgX) != cv::Vec3b(255, 255, 255)) {
-					if (imgY != 0 && img.at<cv::Vec3b>(imgY - 1, imgX) == cv::Vec3b(255, 255, 255)) {
-						altered++;
-						for (int k = 0; k < chokeMatte; k++) {
-							if (imgY + k > img.rows - 1) {
-								dstImg.at<cv::Vec3b>(img.rows - 1, imgX) = cv::Vec3b(255, 255, 255);
-							}
-							else {
-								dstImg.at<cv::Vec3b>(imgY + k, imgX) = cv::Vec3b(255, 255, 255);
-							}
-						}
-						imgY += chokeMatte;
-					}
-					else if (img.at<cv::Vec3b>(imgY + 1, imgX) == cv::Vec3b(255, 255, 255)) {
-						altered++;
-						for (int k = 0; k < chokeMatte; k++) {
-							if (imgY - k < 0) {
-								dstImg.at<cv::Vec3b>(0, imgX) = cv::Vec3b(255, 255, 255);
-							}
-							else {
-								dstImg.at<cv::Vec3b>(imgY - k, imgX) = cv::Vec3b(255, 255, 255);
-							}
-						}
-					}
+	// Sets dstMask where a white pixel of srcMask is at most radius away along the row. Each direction
+	// keeps the distance to the last white pixel, so the cost does not depend on radius, and outside
+	// the image counts as non-white.
+	static void chokeRow(const uchar* srcMask, uchar* dstMask, int cols, int radius) {
+		int distance = radius + 1;
+		for (int imgX = 0; imgX < cols; imgX++) {
+			distance = srcMask[imgX] ? 0 : std::min(distance + 1, radius + 1);
+			dstMask[imgX] = distance <= radius;
+		}
 
-					if (altered == 0) {
-						dstImg.at<cv::Vec3b>(imgY, imgX) = img.at<cv::Vec3b>(imgY, imgX);
-					}
-				}
+		distance = radius + 1;
+		for (int imgX = cols - 1; imgX >= 0; imgX--) {
+			distance = srcMask[imgX] ? 0 : std::min(distance + 1, radius + 1);
+			dstMask[imgX] |= distance <= radius;
+		}
+	}
 
-				else {
-					dstImg.at<cv::Vec3b>(imgY, imgX) = img.at<cv::Vec3b>(imgY, imgX);
-				}
+	// Same along the columns, sweeping whole rows of a column band so memory is read row by row.
+	static void chokeColumns(const cv::Mat_<uchar>& srcMask, cv::Mat_<uchar>& dstMask, const cv::Rect& band, int radius) {
+		std::vector<int> distances(band.width, radius + 1);
+		for (int imgY = 0; imgY < srcMask.rows; imgY++) {
+			auto srcRow = srcMask.ptr<uchar>(imgY) + band.x;
+			auto dstRow = dstMask.ptr<uchar>(imgY) + band.x;
+			for (int x = 0; x < band.width; x++) {
+				distances[x] = srcRow[x] ? 0 : std::min(distances[x] + 1, radius + 1);
+				dstRow[x] = distances[x] <= radius;
+			}
+		}
+
+		std::fill(distances.begin(), distances.end(), radius + 1);
+		for (int imgY = srcMask.rows - 1; imgY >= 0; imgY--) {
+			auto srcRow = srcMask.ptr<uchar>(imgY) + band.x;
+			auto dstRow = dstMask.ptr<uchar>(imgY) + band.x;
+			for (int x = 0; x < band.width; x++) {
+				distances[x] = srcRow[x] ? 0 : std::min(distances[x] + 1, radius + 1);
+				dstRow[x] |= distances[x] <= radius;
 			}
 		}
+	}
+
+public:
+	// Erodes the non-white regions by chokeMatte1 / 2 pixels: a pixel turns white when a white pixel
+	// lies within that distance along both axes (a square window), done as one pass per axis.
+	cv::Mat apply(cv::Mat img) {
+		const int radius = chokeMatte1 / 2;
+		auto dstImg = BufferPool::shared().clone(img);
+		if (radius <= 0) {
+			return dstImg;
+		}
+
+		cv::Mat_<uchar> whiteImg = BufferPool::shared().acquire(img.size(), CV_8UC1);
+		dispatchPixelType(img.type(), [&]<typename T>(T) {
+			TileScheduler::rowBands().run(img.size(), cv::Size(0, 0), [&](const Tile& tile) {
+				for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+					whiteRow(img.ptr<T>(imgY), whiteImg.ptr<uchar>(imgY), img.cols);
+				}
+			});
+		});
+
+		cv::Mat_<uchar> chokedXImg = BufferPool::shared().acquire(img.size(), CV_8UC1);
+		TileScheduler::rowBands().run(img.size(), cv::Size(0, 0), [&](const Tile& tile) {
+			for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+				chokeRow(whiteImg.ptr<uchar>(imgY), chokedXImg.ptr<uchar>(imgY), img.cols, radius);
+			}
+		});
+
+		cv::Mat_<uchar> chokedImg = BufferPool::shared().acquire(img.size(), CV_8UC1);
+		TileScheduler::columnBands(256).run(img.size(), cv::Size(0, 0), [&](const Tile& tile) {
+			chokeColumns(chokedXImg, chokedImg, tile.rect, radius);
+		});
+
+		dispatchPixelType(img.type(), [&]<typename T>(T) {
+			TileScheduler::rowBands().run(img.size(), cv::Size(0, 0), [&](const Tile& tile) {
+				for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+					auto chokedRow = chokedImg.ptr<uchar>(imgY);
+					auto dstRow = dstImg.ptr<T>(imgY);
+					for (int imgX = 0; imgX < img.cols; imgX++) {
+						if (chokedRow[imgX]) {
+							dstRow[imgX] = whitePixel<T>();
+						}
+					}
+				}
+			});
+		});
 
 		return dstImg;
 	}
+};
 
-	cv::Mat applyChokeX(cv::Mat img, int chokeMatte) {
-		auto dstImg = cv::Mat(img.size(), img.type());
+inline cv::Mat applyLayers(std::vector<cv::Mat> srcImgs) {
+	CV_Assert(!srcImgs.empty());
+	for (const auto& srcImg : srcImgs) {
+		CV_Assert(srcImg.size() == srcImgs[0].size() && srcImg.type() == srcImgs[0].type());
+	}
 
-		for (int imgY = 0; imgY < img.rows - 1; imgY++) {
-			for (int imgX = 0; imgX < img.cols - 1; imgX++) {
-				int altered = 0;
-				if (img.at<cv::Vec3b>(imgY, imgX) != cv::Vec3b(255, 255, 255)) {
-					if (img.at<cv::Vec3b>(imgY, imgX - 1) == cv::Vec3b(255, 255, 255)) {
-						altered++;
-						for (int k = 0; k < chokeMatte; k++) {
-							if (imgX + k > img.cols - 1) {
-								dstImg.at<cv::Vec3b>(imgY, img.cols - 1) = cv::Vec3b(255, 255, 255);
-							}
-							else {
-								dstImg.at<cv::Vec3b>(imgY, imgX + k) = cv::Vec3b(255, 255, 255);
+	auto dstImg = BufferPool::shared().acquire(srcImgs.at(0).size(), srcImgs.at(0).type());
+	int srcCount = static_cast<int>(srcImgs.size());
+
+	dispatchPixelType(dstImg.type(), [&]<typename T>(T) {
+		using Sample = typename T::value_type;
+		using Sum = std::conditional_t<std::is_floating_point_v<Sample>, double, int64_t>;
+
+		TileScheduler::rowBands().run(dstImg.size(), cv::Size(0, 0), [&](const Tile& tile) {
+			std::vector<const T*> srcRows(srcImgs.size());
+			std::vector<std::vector<uchar>> whiteRows(srcImgs.size(), std::vector<uchar>(dstImg.cols));
+
+			for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+				for (size_t i = 0; i < srcImgs.size(); i++) {
+					srcRows[i] = srcImgs[i].ptr<T>(imgY);
+					whiteRow(srcRows[i], whiteRows[i].data(), dstImg.cols);
+				}
+				auto dstRow = dstImg.ptr<T>(imgY);
+
+				for (int imgX = 0; imgX < dstImg.cols; imgX++) {
+					int whiteBuff = 0;
+					Sum totals[T::channels] = {};
+					for (size_t i = 0; i < srcImgs.size(); i++) {
+						if (whiteRows[i][imgX]) {
+							whiteBuff++;
+						}
+						else {
+							for (int c = 0; c < T::channels; c++) {
+								totals[c] += srcRows[i][imgX][c];
 							}
 						}
-						imgX += chokeMatte;
 					}
-					else if (img.at<cv::Vec3b>(imgY, imgX + 1) == cv::Vec3b(255, 255, 255)) {
-						altered++;
-						for (int k = 0; k < chokeMatte; k++) {
-							if (imgX - k < img.cols) {
-								dstImg.at<cv::Vec3b>(imgY, img.cols) = cv::Vec3b(255, 255, 255);
-							}
-							else {
-								dstImg.at<cv::Vec3b>(imgY, imgX - k) = cv::Vec3b(255, 255, 255);
-							}
+					if (whiteBuff == srcCount) {
+						dstRow[imgX] = whitePixel<T>();
+					}
+					else {
+						for (int c = 0; c < T::channels; c++) {
+							dstRow[imgX][c] = static_cast<Sample>(totals[c] / (srcCount - whiteBuff));
 						}
-
 					}
+				}
+			}
+		});
+	});
+	return dstImg;
+}
+
+// dstRow = (dstRow * (256 - weights) + fgRow * weights + 128) >> 8 for length bytes. The sum is at
+// most 255 * 256 + 128, so it stays within unsigned 16 bits.
+inline void blendRow(uchar* dstRow, const uchar* fgRow, const int16_t* weights, int length) {
+	const auto full = simd::set1I16(256);
+	const auto half = simd::set1I16(128);
+
+	int i = 0;
+	for (; i + simd::i16::lanes <= length; i += simd::i16::lanes) {
+		const auto weight = simd::loadI16(weights + i);
+		const auto bg = simd::mulLow(simd::loadU8AsI16(dstRow + i), simd::sub(full, weight));
+		const auto fg = simd::mulLow(simd::loadU8AsI16(fgRow + i), weight);
+		simd::storeU8(dstRow + i, simd::shiftRightUnsigned(simd::add(simd::add(bg, fg), half), 8));
+	}
+	for (; i < length; i++) {
+		dstRow[i] = static_cast<uchar>((dstRow[i] * (256 - weights[i]) + fgRow[i] * weights[i] + 128) >> 8);
+	}
+}
+
+// 16-bit and float samples are blended in float, where weight 1 gives fgRow exactly.
+template<typename S>
+inline void blendRow(S* dstRow, const S* fgRow, const float* weights, int length) {
+	for (int i = 0; i < length; i++) {
+		dstRow[i] = cv::saturate_cast<S>(dstRow[i] + (static_cast<float>(fgRow[i]) - dstRow[i]) * weights[i]);
+	}
+}
+
+// Stacks layers bottom to top in one pass: layers[i + 1] goes over the result so far with opacity
+// alphas[i]. White is transparent, so a white pixel of the upper layer keeps the one below, and a
+// white pixel below takes the upper one as is. Each row is built in the output, layer by layer.
+// 8-bit opacities are 8-bit fixed point, so results may differ from a double-precision blend by one.
+inline cv::Mat compositeLayers(const std::vector<cv::Mat>& layers, const std::vector<double>& alphas) {
+	CV_Assert(!layers.empty() && alphas.size() + 1 == layers.size());
+	for (const auto& layer : layers) {
+		CV_Assert(layer.size() == layers[0].size() && layer.type() == layers[0].type());
+	}
+
+	auto dstImg = BufferPool::shared().acquire(layers[0].size(), layers[0].type());
+	dispatchPixelType(dstImg.type(), [&]<typename T>(T) {
+		using Sample = typename T::value_type;
+		constexpr bool isFixedPoint = std::is_same_v<Sample, uchar>;
+		using Weight = std::conditional_t<isFixedPoint, int16_t, float>;
+		const Weight opaque = isFixedPoint ? 256 : 1;
+
+		std::vector<Weight> layerWeights;
+		for (const auto alpha : alphas) {
+			const double clampedAlpha = std::clamp(alpha, 0.0, 1.0);
+			layerWeights.push_back(isFixedPoint ? static_cast<Weight>(cvRound(clampedAlpha * 256)) : static_cast<Weight>(clampedAlpha));
+		}
+
+		const int rowLength = dstImg.cols * T::channels;
+
+		TileScheduler::rowBands().run(dstImg.size(), cv::Size(0, 0), [&](const Tile& tile) {
+			std::vector<uchar> bgWhiteRow(dstImg.cols);
+			std::vector<uchar> fgWhiteRow(dstImg.cols);
+			std::vector<Weight> weightRow(rowLength);
+
+			for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+				auto dstRow = dstImg.ptr<T>(imgY);
+				std::memcpy(dstRow, layers[0].ptr<T>(imgY), rowLength * sizeof(Sample));
+
+				for (size_t i = 1; i < layers.size(); i++) {
+					auto fgRow = layers[i].ptr<T>(imgY);
+					whiteRow(dstRow, bgWhiteRow.data(), dstImg.cols);
+					whiteRow(fgRow, fgWhiteRow.data(), dstImg.cols);
 
-					if (altered == 0) {
-						dstImg.at<cv::Vec3b>(imgY, imgX) = img.at<cv::Vec3b>(imgY, imgX);
+					// Weight 0 keeps the lower pixel and opaque takes the upper one exactly.
+					for (int imgX = 0; imgX < dstImg.cols; imgX++) {
+						const Weight weight = fgWhiteRow[imgX] ? 0 : bgWhiteRow[imgX] ? opaque : layerWeights[i - 1];
+						std::fill_n(weightRow.data() + imgX * T::channels, T::channels, weight);
 					}
-				}
-				else {
-					dstImg.at<cv::Vec3b>(imgY, imgX) = img.at<cv::Vec3b>(imgY, imgX);
+
+					blendRow(reinterpret_cast<Sample*>(dstRow), reinterpret_cast<const Sample*>(fgRow), weightRow.data(), rowLength);
 				}
 			}
-		}
+		});
+	});
+	return dstImg;
+}
 
-		return dstImg;
-	}
+inline cv::Mat applyLayersWithAlpha(cv::Mat bg, cv::Mat fg, double alpha) {
+	return compositeLayers({ bg, fg }, { alpha });
+}
 
-public:
-	cv::Mat apply(cv::Mat img) {
-		int chokeMatte = chokeMatte1 / 2;
-		auto chokedXImg = applyChokeX(img, chokeMatte);
-		return applyChokeY(chokedXImg, chokeMatte);
+inline cv::Mat applyAlpha(cv::Mat image, double alpha) {
+	if (alpha > 1) {
+		alpha = 1;
 	}
-};
 
-cv::Mat applyLayers(std::vector<cv::Mat> srcImgs) {
-	auto dstImg = cv::Mat(srcImgs.at(0).size(), srcImgs.at(0).type());
-	int srcCount = static_cast<int>(srcImgs.size());
+	auto dstImg = BufferPool::shared().acquire(image.size(), image.type());
+	dispatchPixelType(image.type(), [&]<typename T>(T) {
+		const T white = whitePixel<T>();
+		for (int imgY = 0; imgY < image.rows; imgY++) {
+			for (int imgX = 0; imgX < image.cols; imgX++) {
+				if (isWhite(image.at<T>(imgY, imgX))) {
+					dstImg.at<T>(imgY, imgX) = white;
 
-	for (int imgY = 0; imgY < srcImgs.at(0).rows; imgY++) {
-		for (int imgX = 0; imgX < srcImgs.at(0).cols; imgX++) {
-			int whiteBuff = 0;
-			int totalB = 0;
-			int totalG = 0;
-			int totalR = 0;
-			for (cv::Mat img : srcImgs) {
-				if (img.at<cv::Vec3b>(imgY, imgX) == cv::Vec3b(255, 255, 255)) {
-					whiteBuff++;
 				}
 				else {
-					totalB += img.at<cv::Vec3b>(imgY, imgX)[0];
-					totalG += img.at<cv::Vec3b>(imgY, imgX)[1];
-					totalR += img.at<cv::Vec3b>(imgY, imgX)[2];
+					dstImg.at<T>(imgY, imgX) = image.at<T>(imgY, imgX) * alpha + white * (1 - alpha);
 				}
 			}
-			if (whiteBuff == srcImgs.size()) {
-				dstImg.at<cv::Vec3b>(imgY, imgX) = cv::Vec3b(255, 255, 255);
-			}
-			else {
-				dstImg.at<cv::Vec3b>(imgY, imgX) = cv::Vec3b(totalB / (srcCount - whiteBuff), totalG / (srcCount - whiteBuff), totalR / (srcCount - whiteBuff));
-			}
+
 		}
+	});
 
-	}
 	return dstImg;
 }
 
-cv::Mat applyLayersWithAlpha(cv::Mat bg, cv::Mat fg, double alpha) {
-	if (alpha > 1) {
-		alpha = 1;
+// A lazily evaluated chain of filters. Runs of adjacent local filters with small halos are fused:
+// each output tile is pushed through the whole run at once, on a crop grown by the halos of the
+// stages still to come, so only the last stage of the run writes a full frame.
+class Pipeline : public Filter {
+public:
+	std::vector<std::shared_ptr<Filter>> filters;
+	int maxFusedHalo = 8;
+	cv::Size fusedTileSize = cv::Size(256, 64);
+
+	Pipeline() {}
+
+	Pipeline(std::span<const std::shared_ptr<Filter>> _filters) : filters(_filters.begin(), _filters.end()) {}
+
+	Pipeline& then(std::shared_ptr<Filter> filter) {
+		filters.push_back(filter);
+		return *this;
 	}
 
-	auto dstImg = cv::Mat(bg.size(), bg.type());
-	for (int imgY = 0; imgY < bg.rows; imgY++) {
-		for (int imgX = 0; imgX < bg.cols; imgX++) {
-			if (fg.at<cv::Vec3b>(imgY, imgX) == cv::Vec3b(255, 255, 255)) {
-				dstImg.at<cv::Vec3b>(imgY, imgX) = bg.at<cv::Vec3b>(imgY, imgX);
+	cv::Size halo() const {
+		cv::Size totalHalo(0, 0);
+		for (const auto& filter : filters) {
+			totalHalo += filter->halo();
+		}
+		return totalHalo;
+	}
 
+	bool isLocal() const {
+		return std::all_of(filters.begin(), filters.end(), [](const std::shared_ptr<Filter>& filter) { return filter->isLocal(); });
+	}
+
+	std::string signature() const {
+		std::string pipelineSignature = "Pipeline(";
+		for (const auto& filter : filters) {
+			const auto filterSignature = filter->signature();
+			if (filterSignature.empty()) {
+				return "";
 			}
-			else if (bg.at<cv::Vec3b>(imgY, imgX) == cv::Vec3b(255, 255, 255)) {
-				dstImg.at<cv::Vec3b>(imgY, imgX) = fg.at<cv::Vec3b>(imgY, imgX);
-			}
-			else {
-				auto bgPixel = bg.at<cv::Vec3b>(imgY, imgX);
-				auto fgPixel = fg.at<cv::Vec3b>(imgY, imgX);
-				dstImg.at<cv::Vec3b>(imgY, imgX) = bgPixel * (1 - alpha) + fgPixel * alpha;
-			}
+			pipelineSignature += filterSignature + ";";
 		}
+		return pipelineSignature + ")";
 	}
-	return dstImg;
-}
 
-cv::Mat applyAlpha(cv::Mat image, double alpha) {
-	if (alpha > 1) {
-		alpha = 1;
+	bool isFrameDependent() const {
+		return std::any_of(filters.begin(), filters.end(), [](const std::shared_ptr<Filter>& filter) { return filter->isFrameDependent(); });
+	}
+
+	void setFrameIndex(uint64_t frameIndex) {
+		for (auto& filter : filters) {
+			filter->setFrameIndex(frameIndex);
+		}
 	}
 
-	auto dstImg = cv::Mat(image.size(), image.type());
-	for (int imgY = 0; imgY < image.rows - 1; imgY++) {
-		for (int imgX = 0; imgX < image.cols - 1; imgX++) {
-			if (image.at<cv::Vec4b>(imgY, imgX) == cv::Vec4b(255, 255, 255, 255)) {
-				dstImg.at<cv::Vec4b>(imgY, imgX) = cv::Vec4b(255, 255, 255, 255);
+	cv::Mat apply(cv::Mat srcImg) {
+		auto img = srcImg;
+
+		size_t stageIdx = 0;
+		while (stageIdx < filters.size()) {
+			size_t stageEnd = stageIdx;
+			while (stageEnd < filters.size() && isFusable(*filters[stageEnd])) {
+				stageEnd++;
+			}
 
+			if (stageEnd - stageIdx >= 2) {
+				trace::Scope scope("filter", [&] { return fusedName(stageIdx, stageEnd); });
+				img = applyFused(img, stageIdx, stageEnd);
+				scope.setPixels(img.total());
+				stageIdx = stageEnd;
 			}
 			else {
-				dstImg.at<cv::Vec4b>(imgY, imgX) = image.at<cv::Vec4b>(imgY, imgX) * alpha + cv::Vec4b(255, 255, 255, 255) * (1 - alpha);
+				trace::Scope scope("filter", [&] { return trace::typeName(typeid(*filters[stageIdx])); });
+				img = filters[stageIdx]->apply(img);
+				scope.setPixels(img.total());
+				stageIdx++;
 			}
 		}
 
+		return img;
 	}
 
-	return dstImg;
-}
+private:
+	std::string fusedName(size_t stageStart, size_t stageEnd) const {
+		std::string name = "Fused(";
+		for (size_t i = stageStart; i < stageEnd; i++) {
+			name += (i > stageStart ? "," : "") + trace::typeName(typeid(*filters[i]));
+		}
+		return name + ")";
+	}
 
-cv::Mat applyFilters(cv::Mat srcImg, const std::span<const std::shared_ptr<Filter>> filters) {
-	auto img = srcImg;
+	bool isFusable(const Filter& filter) const {
+		const auto filterHalo = filter.halo();
+		return filter.isLocal() && filterHalo.width <= maxFusedHalo && filterHalo.height <= maxFusedHalo;
+	}
+
+	cv::Mat applyFused(const cv::Mat& srcImg, size_t stageStart, size_t stageEnd) {
+		const cv::Rect imgRect(0, 0, srcImg.cols, srcImg.rows);
+
+		// remainingHalos[i] is how far past a tile stage i has to produce correct pixels.
+		std::vector<cv::Size> remainingHalos(stageEnd - stageStart + 1, cv::Size(0, 0));
+		for (size_t i = stageEnd; i-- > stageStart;) {
+			remainingHalos[i - stageStart] = remainingHalos[i - stageStart + 1] + filters[i]->halo();
+		}
+
+		cv::Mat dstImg;
+		std::mutex dstMutex;
+
+		TileScheduler(fusedTileSize).run(srcImg.size(), cv::Size(0, 0), [&](const Tile& tile) {
+			auto grow = [&](cv::Size margin) {
+				return cv::Rect(tile.rect.x - margin.width, tile.rect.y - margin.height, tile.rect.width + 2 * margin.width, tile.rect.height + 2 * margin.height) & imgRect;
+			};
+
+			cv::Rect rect = grow(remainingHalos[0]);
+			cv::Mat img = srcImg(rect);
+
+			for (size_t i = stageStart; i < stageEnd; i++) {
+				img = filters[i]->apply(img);
 
-	for (auto filter : filters) {
-		img = filter->apply(img);
+				const cv::Rect nextRect = grow(remainingHalos[i - stageStart + 1]);
+				img = img(nextRect - rect.tl());
+				rect = nextRect;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(dstMutex);
+				if (dstImg.empty()) {
+					dstImg = BufferPool::shared().acquire(srcImg.size(), img.type());
+				}
+			}
+			img.copyTo(dstImg(tile.rect));
+		});
+
+		return dstImg;
 	}
+};
 
-	return img;
+inline cv::Mat applyFilters(cv::Mat srcImg, const std::span<const std::shared_ptr<Filter>> filters) {
+	return Pipeline(filters).apply(srcImg);
 }
 
-cv::Mat applyFilters(cv::Mat srcImg, const std::initializer_list<std::shared_ptr<Filter>> filters) {
+inline cv::Mat applyFilters(cv::Mat srcImg, const std::initializer_list<std::shared_ptr<Filter>> filters) {
 	std::span _span(filters.begin(), filters.size());
 	return applyFilters(srcImg, _span);
 }
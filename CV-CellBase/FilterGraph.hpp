@@ -0,0 +1,249 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Filter.hpp"
+#include "Trace.hpp"
+
+// A processing recipe declared as a DAG: the source image, filter nodes and composite nodes.
+// Adding a node that is already in the graph (same signature on the same inputs) returns the
+// existing node, so branches that share a prefix compute it once.
+class FilterGraph {
+public:
+	using Node = int;
+	using Composite = std::function<cv::Mat(const std::vector<cv::Mat>&)>;
+
+	// The source image is always node 0.
+	static constexpr Node source = 0;
+
+	FilterGraph() {
+		nodes.push_back(NodeInfo());
+	}
+
+	Node add(Node input, std::shared_ptr<Filter> filter) {
+		return addNode(filter->signature(), { input }, filter, nullptr);
+	}
+
+	// Adds one node per filter so that every prefix of the chain can be shared.
+	Node add(Node input, std::initializer_list<std::shared_ptr<Filter>> filters) {
+		Node node = input;
+		for (const auto& filter : filters) {
+			node = add(node, filter);
+		}
+		return node;
+	}
+
+	// compositeSignature plays the role of Filter::signature for the composite function.
+	Node composite(std::vector<Node> inputs, Composite composite, const std::string& compositeSignature = "") {
+		return addNode(compositeSignature, inputs, nullptr, composite);
+	}
+
+	Node layersWithAlpha(Node bg, Node fg, double alpha) {
+		return composite({ bg, fg }, [alpha](const std::vector<cv::Mat>& imgs) { return applyLayersWithAlpha(imgs[0], imgs[1], alpha); },
+			"applyLayersWithAlpha(" + std::to_string(alpha) + ")");
+	}
+
+	// inputs[i + 1] over the ones below it with opacity alphas[i], without intermediate frames.
+	Node compositeLayers(std::vector<Node> inputs, std::vector<double> alphas) {
+		std::string sig = "compositeLayers(";
+		for (const auto alpha : alphas) {
+			sig += std::to_string(alpha) + ",";
+		}
+		sig += ")";
+		return composite(inputs, [alphas](const std::vector<cv::Mat>& imgs) { return ::compositeLayers(imgs, alphas); }, sig);
+	}
+
+	Node layers(std::vector<Node> inputs) {
+		return composite(inputs, [](const std::vector<cv::Mat>& imgs) { return applyLayers(imgs); }, "applyLayers");
+	}
+
+	void setOutput(const std::string& name, Node node) {
+		outputs[name] = node;
+	}
+
+	Node output(const std::string& name) const {
+		return outputs.at(name);
+	}
+
+	size_t nodeCount() const {
+		return nodes.size();
+	}
+
+	// How far a pixel of node reaches into the source image. Composites combine their inputs pixel
+	// by pixel, so only filters add to it.
+	cv::Size reach(Node node) const {
+		cv::Size nodeReach(0, 0);
+		for (const auto input : nodes[node].inputs) {
+			const auto inputReach = reach(input);
+			nodeReach = cv::Size(std::max(nodeReach.width, inputReach.width), std::max(nodeReach.height, inputReach.height));
+		}
+		if (nodes[node].filter) {
+			nodeReach += nodes[node].filter->halo();
+		}
+		return nodeReach;
+	}
+
+	// True when node can be computed on a crop of the source (see Filter::isLocal).
+	bool isLocal(Node node) const {
+		if (nodes[node].filter && !nodes[node].filter->isLocal()) {
+			return false;
+		}
+		return std::all_of(nodes[node].inputs.begin(), nodes[node].inputs.end(), [&](Node input) { return isLocal(input); });
+	}
+
+	// True when node depends on the frame index (see Filter::isFrameDependent).
+	bool isFrameDependent(Node node) const {
+		if (nodes[node].filter && nodes[node].filter->isFrameDependent()) {
+			return true;
+		}
+		return std::any_of(nodes[node].inputs.begin(), nodes[node].inputs.end(), [&](Node input) { return isFrameDependent(input); });
+	}
+
+	// Passes the index of the frame about to be run to every filter.
+	void setFrameIndex(uint64_t frameIndex) {
+		for (auto& info : nodes) {
+			if (info.filter) {
+				info.filter->setFrameIndex(frameIndex);
+			}
+		}
+	}
+
+	std::map<std::string, cv::Mat> run(cv::Mat srcImg) const {
+		std::vector<Node> targets;
+		for (const auto& [name, node] : outputs) {
+			targets.push_back(node);
+		}
+
+		const auto results = evaluate(srcImg, targets);
+
+		std::map<std::string, cv::Mat> dstImgs;
+		for (const auto& [name, node] : outputs) {
+			dstImgs[name] = results.at(node);
+		}
+		return dstImgs;
+	}
+
+	cv::Mat run(cv::Mat srcImg, Node node) const {
+		return evaluate(srcImg, { node }).at(node);
+	}
+
+private:
+	struct NodeInfo {
+		std::vector<Node> inputs;
+		std::shared_ptr<Filter> filter;
+		Composite composite;
+		std::string signature;
+	};
+
+	std::vector<NodeInfo> nodes;
+	std::map<std::string, Node> nodeKeys;
+	std::map<std::string, Node> outputs;
+
+	Node addNode(const std::string& nodeSignature, const std::vector<Node>& inputs, std::shared_ptr<Filter> filter, Composite composite) {
+		for (const auto input : inputs) {
+			CV_Assert(0 <= input && input < static_cast<Node>(nodes.size()));
+		}
+
+		std::string key;
+		if (!nodeSignature.empty()) {
+			key = nodeSignature + "@";
+			for (const auto input : inputs) {
+				key += std::to_string(input) + ",";
+			}
+
+			auto found = nodeKeys.find(key);
+			if (found != nodeKeys.end()) {
+				return found->second;
+			}
+		}
+
+		nodes.push_back(NodeInfo{ inputs, filter, composite, nodeSignature });
+		const Node node = static_cast<Node>(nodes.size()) - 1;
+		if (!key.empty()) {
+			nodeKeys[key] = node;
+		}
+		return node;
+	}
+
+	// Nodes only refer to earlier nodes, so creation order is a topological order. A filter node
+	// whose only consumer is another filter node is folded into that consumer's Pipeline, letting
+	// Pipeline fuse it, and an intermediate image is released once its last consumer has run.
+	std::map<Node, cv::Mat> evaluate(cv::Mat srcImg, const std::vector<Node>& targets) const {
+		std::vector<bool> needed(nodes.size(), false);
+		std::vector<bool> isTarget(nodes.size(), false);
+		for (const auto target : targets) {
+			needed[target] = true;
+			isTarget[target] = true;
+		}
+
+		std::vector<int> consumerCounts(nodes.size(), 0);
+		for (Node node = static_cast<Node>(nodes.size()) - 1; node > source; node--) {
+			if (!needed[node]) {
+				continue;
+			}
+			for (const auto input : nodes[node].inputs) {
+				needed[input] = true;
+				consumerCounts[input]++;
+			}
+		}
+
+		std::vector<bool> folded(nodes.size(), false);
+		for (Node node = source + 1; node < static_cast<Node>(nodes.size()); node++) {
+			if (needed[node] && nodes[node].filter) {
+				const auto input = nodes[node].inputs[0];
+				if (input != source && nodes[input].filter && consumerCounts[input] == 1 && !isTarget[input]) {
+					folded[input] = true;
+				}
+			}
+		}
+
+		std::vector<cv::Mat> results(nodes.size());
+		results[source] = srcImg;
+
+		auto release = [&](Node input) {
+			if (--consumerCounts[input] == 0 && !isTarget[input]) {
+				results[input].release();
+			}
+		};
+
+		for (Node node = source + 1; node < static_cast<Node>(nodes.size()); node++) {
+			if (!needed[node] || folded[node]) {
+				continue;
+			}
+
+			const auto& info = nodes[node];
+			if (info.filter) {
+				std::vector<std::shared_ptr<Filter>> chain = { info.filter };
+				Node input = info.inputs[0];
+				while (folded[input]) {
+					chain.insert(chain.begin(), nodes[input].filter);
+					input = nodes[input].inputs[0];
+				}
+
+				results[node] = Pipeline(chain).apply(results[input]);
+				release(input);
+			}
+			else {
+				std::vector<cv::Mat> inputImgs;
+				for (const auto input : info.inputs) {
+					inputImgs.push_back(results[input]);
+				}
+
+				trace::Scope scope("composite", [&] { return info.signature.empty() ? std::string("composite") : info.signature; });
+				results[node] = info.composite(inputImgs);
+				scope.setPixels(results[node].total());
+				for (const auto input : info.inputs) {
+					release(input);
+				}
+			}
+		}
+
+		std::map<Node, cv::Mat> dstImgs;
+		for (const auto target : targets) {
+			dstImgs[target] = results[target];
+		}
+		return dstImgs;
+	}
+};
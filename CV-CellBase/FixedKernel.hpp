@@ -0,0 +1,146 @@
+#pragma once
+#include <array>
+
+// A kernel known at compile time, passed as a template argument so convolution loops over it are
+// fully unrolled and zero weights are dropped. weights is row-major. When the kernel is the outer
+// product col * row, isSeparable is set and the two passes use row and col instead.
+template<int W, int H>
+struct FixedKernel {
+	static constexpr int width = W;
+	static constexpr int height = H;
+
+	std::array<float, W * H> weights{};
+	std::array<float, W> row{};
+	std::array<float, H> col{};
+	bool isSeparable = false;
+
+	constexpr float operator()(int kernelY, int kernelX) const {
+		return weights[kernelY * W + kernelX];
+	}
+
+	static constexpr FixedKernel fromSeparable(const std::array<float, W>& row, const std::array<float, H>& col) {
+		FixedKernel kernel;
+		kernel.row = row;
+		kernel.col = col;
+		kernel.isSeparable = true;
+		for (int kernelY = 0; kernelY < H; kernelY++) {
+			for (int kernelX = 0; kernelX < W; kernelX++) {
+				kernel.weights[kernelY * W + kernelX] = col[kernelY] * row[kernelX];
+			}
+		}
+		return kernel;
+	}
+
+	// Factors a rank-1 kernel the way LinearFilter::separateKernel does, so both give the same passes.
+	static constexpr FixedKernel fromWeights(const std::array<float, W * H>& weights) {
+		auto abs = [](float x) { return x < 0 ? -x : x; };
+
+		FixedKernel kernel;
+		kernel.weights = weights;
+
+		int pivotY = 0;
+		int pivotX = 0;
+		for (int kernelY = 0; kernelY < H; kernelY++) {
+			for (int kernelX = 0; kernelX < W; kernelX++) {
+				if (abs(kernel(kernelY, kernelX)) > abs(kernel(pivotY, pivotX))) {
+					pivotY = kernelY;
+					pivotX = kernelX;
+				}
+			}
+		}
+
+		const float pivot = kernel(pivotY, pivotX);
+		if (pivot == 0.0f) {
+			return kernel;
+		}
+
+		for (int kernelX = 0; kernelX < W; kernelX++) {
+			kernel.row[kernelX] = kernel(pivotY, kernelX) / pivot;
+		}
+		for (int kernelY = 0; kernelY < H; kernelY++) {
+			kernel.col[kernelY] = kernel(kernelY, pivotX);
+		}
+
+		const float tolerance = abs(pivot) * 1e-6f;
+		kernel.isSeparable = true;
+		for (int kernelY = 0; kernelY < H; kernelY++) {
+			for (int kernelX = 0; kernelX < W; kernelX++) {
+				if (abs(kernel(kernelY, kernelX) - kernel.col[kernelY] * kernel.row[kernelX]) > tolerance) {
+					kernel.isSeparable = false;
+				}
+			}
+		}
+
+		return kernel;
+	}
+};
+
+namespace fixedKernels {
+
+// std::exp is not constexpr: exp(x) = 2^n * exp(r) with |r| <= ln(2) / 2 and a Taylor series for
+// exp(r), accurate to a few ulps of a double.
+constexpr double exp(double x) {
+	constexpr double ln2 = 0.693147180559945309417;
+	int n = static_cast<int>(x / ln2 + (x < 0 ? -0.5 : 0.5));
+	const double r = x - n * ln2;
+
+	double term = 1.0;
+	double sum = 1.0;
+	for (int i = 1; i < 25; i++) {
+		term *= r / i;
+		sum += term;
+	}
+
+	for (; n > 0; n--) {
+		sum *= 2.0;
+	}
+	for (; n < 0; n++) {
+		sum /= 2.0;
+	}
+	return sum;
+}
+
+constexpr FixedKernel<3, 3> sobelX() {
+	return FixedKernel<3, 3>::fromWeights({
+		1, 0, -1,
+		2, 0, -2,
+		1, 0, -1 });
+}
+
+constexpr FixedKernel<3, 3> sobelY() {
+	return FixedKernel<3, 3>::fromWeights({
+		1, 2, 1,
+		0, 0, 0,
+		-1, -2, -1 });
+}
+
+// Same weights as AveragingBlur.
+template<int W, int H>
+constexpr FixedKernel<W, H> box() {
+	std::array<float, W> row{};
+	std::array<float, H> col{};
+	row.fill(1.0f / W);
+	col.fill(1.0f / H);
+	return FixedKernel<W, H>::fromSeparable(row, col);
+}
+
+// Same weights as GaussianBlur(sigma, size).
+template<int Size>
+constexpr FixedKernel<Size, Size> gaussian(float sigma) {
+	std::array<float, Size> weights{};
+	float gauss_total = 0.0f;
+	constexpr int center = Size / 2;
+
+	for (int i = 0; i < Size; i++) {
+		int length = center - i;
+		weights[i] = static_cast<float>(exp(-static_cast<float>(length * length) / (2 * sigma * sigma)));
+		gauss_total += weights[i];
+	}
+
+	for (int i = 0; i < Size; i++) {
+		weights[i] /= gauss_total;
+	}
+
+	return FixedKernel<Size, Size>::fromSeparable(weights, weights);
+}
+}
@@ -0,0 +1,255 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "FilterGraph.hpp"
+#include "TileScheduler.hpp"
+
+// True when both images have the same size, type and pixels.
+inline bool isSameImage(const cv::Mat& img, const cv::Mat& otherImg) {
+	if (img.size() != otherImg.size() || img.type() != otherImg.type()) {
+		return false;
+	}
+
+	const size_t rowBytes = img.cols * img.elemSize();
+	for (int imgY = 0; imgY < img.rows; imgY++) {
+		if (std::memcmp(img.ptr<uchar>(imgY), otherImg.ptr<uchar>(imgY), rowBytes) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Recent outputs keyed by source hash, shared by the processors of several workers so a held frame
+// is reused even when its neighbours went to another worker.
+class HeldFrameCache {
+public:
+	HeldFrameCache(size_t _capacity = 8) : capacity(_capacity) {}
+
+	// The hash only picks candidates; a hit is confirmed against the stored source.
+	bool find(uint64_t srcHash, const cv::Mat& srcImg, cv::Mat& dstImg) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& entry : entries) {
+			if (entry.srcHash == srcHash && isSameImage(entry.srcImg, srcImg)) {
+				dstImg = entry.dstImg;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void insert(uint64_t srcHash, const cv::Mat& srcImg, const cv::Mat& dstImg) {
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.push_back(Entry{ srcHash, srcImg, dstImg });
+		if (entries.size() > capacity) {
+			entries.pop_front();
+		}
+	}
+
+private:
+	struct Entry {
+		uint64_t srcHash;
+		cv::Mat srcImg;
+		cv::Mat dstImg;
+	};
+
+	size_t capacity;
+	std::deque<Entry> entries;
+	std::mutex mutex;
+};
+
+// Runs a graph over consecutive frames, reusing the previous result where the source did not change.
+// A frame identical to the previous one gets the previous output back. Otherwise the changed blocks
+// are found, grown by the graph's reach, and only those regions are recomputed and patched into a
+// copy of the previous output. A graph that is not local is always run on the whole frame, and one
+// that depends on the frame index (see Filter::isFrameDependent) is run in full on every frame.
+class IncrementalProcessor {
+public:
+	int blockSize = 32;
+
+	// Above this fraction of the frame to recompute, one full run is cheaper than many crops.
+	double maxDirtyRatio = 0.5;
+
+	size_t reusedFrames = 0;
+	size_t patchedFrames = 0;
+	size_t fullFrames = 0;
+
+	IncrementalProcessor(FilterGraph _graph, const std::string& _outputName, std::shared_ptr<HeldFrameCache> _heldFrames = nullptr) : graph(_graph), outputName(_outputName), heldFrames(_heldFrames) {
+		const auto outputNode = graph.output(outputName);
+		reach = graph.reach(outputNode);
+		isLocal = graph.isLocal(outputNode);
+		isFrameDependent = graph.isFrameDependent(outputNode);
+	}
+
+	static uint64_t frameHash(const cv::Mat& img) {
+		uint64_t hash = 0x9E3779B97F4A7C15ull ^ (static_cast<uint64_t>(img.rows) << 32) ^ static_cast<uint64_t>(img.cols);
+		const size_t rowBytes = img.cols * img.elemSize();
+
+		for (int imgY = 0; imgY < img.rows; imgY++) {
+			auto row = img.ptr<uchar>(imgY);
+
+			size_t i = 0;
+			for (; i + sizeof(uint64_t) <= rowBytes; i += sizeof(uint64_t)) {
+				uint64_t word;
+				std::memcpy(&word, row + i, sizeof(word));
+				hash = (hash ^ word) * 0x100000001B3ull;
+				hash ^= hash >> 29;
+			}
+			for (; i < rowBytes; i++) {
+				hash = (hash ^ row[i]) * 0x100000001B3ull;
+			}
+		}
+
+		return hash;
+	}
+
+	// frameIndex is the position of srcImg in the sequence.
+	cv::Mat process(const cv::Mat& srcImg, uint64_t frameIndex = 0) {
+		graph.setFrameIndex(frameIndex);
+		if (isFrameDependent) {
+			fullFrames++;
+			return graph.run(srcImg).at(outputName);
+		}
+
+		const auto srcHash = frameHash(srcImg);
+		const bool sameShape = !prevSrcImg.empty() && prevSrcImg.size() == srcImg.size() && prevSrcImg.type() == srcImg.type();
+
+		if (sameShape && srcHash == prevSrcHash && isSameImage(srcImg, prevSrcImg)) {
+			reusedFrames++;
+			return prevDstImg;
+		}
+
+		cv::Mat dstImg;
+		if (heldFrames && heldFrames->find(srcHash, srcImg, dstImg)) {
+			reusedFrames++;
+			remember(srcImg, srcHash, dstImg);
+			return dstImg;
+		}
+
+		std::vector<cv::Rect> dirtyRects;
+		if (sameShape && isLocal) {
+			dirtyRects = collectDirtyRects(srcImg);
+		}
+
+		size_t dirtyArea = 0;
+		for (const auto& rect : dirtyRects) {
+			dirtyArea += grow(rect, srcImg.size()).area();
+		}
+
+		if (!dirtyRects.empty() && dirtyArea <= maxDirtyRatio * srcImg.total()) {
+			dstImg = BufferPool::shared().clone(prevDstImg);
+			for (const auto& rect : dirtyRects) {
+				const auto cropRect = grow(rect, srcImg.size());
+				cv::Mat cropDstImg = graph.run(srcImg(cropRect)).at(outputName);
+				cropDstImg(rect - cropRect.tl()).copyTo(dstImg(rect));
+			}
+			patchedFrames++;
+		}
+		else {
+			dstImg = graph.run(srcImg).at(outputName);
+			fullFrames++;
+		}
+
+		if (heldFrames) {
+			heldFrames->insert(srcHash, srcImg, dstImg);
+		}
+		remember(srcImg, srcHash, dstImg);
+		return dstImg;
+	}
+
+private:
+	FilterGraph graph;
+	std::string outputName;
+	cv::Size reach;
+	bool isLocal;
+	bool isFrameDependent;
+
+	cv::Mat prevSrcImg;
+	uint64_t prevSrcHash = 0;
+	cv::Mat prevDstImg;
+	std::shared_ptr<HeldFrameCache> heldFrames;
+
+	void remember(const cv::Mat& srcImg, uint64_t srcHash, const cv::Mat& dstImg) {
+		prevSrcImg = srcImg;
+		prevSrcHash = srcHash;
+		prevDstImg = dstImg;
+	}
+
+	cv::Rect grow(const cv::Rect& rect, cv::Size imgSize) const {
+		return cv::Rect(rect.x - reach.width, rect.y - reach.height, rect.width + 2 * reach.width, rect.height + 2 * reach.height) & cv::Rect(0, 0, imgSize.width, imgSize.height);
+	}
+
+	// Output regions that may differ from the previous output: changed blocks grown by the reach,
+	// merged until no two overlap so each output pixel is patched once.
+	std::vector<cv::Rect> collectDirtyRects(const cv::Mat& srcImg) const {
+		const int blockCols = (srcImg.cols + blockSize - 1) / blockSize;
+		const int blockRows = (srcImg.rows + blockSize - 1) / blockSize;
+		const size_t elemSize = srcImg.elemSize();
+
+		std::vector<uchar> dirtyBlocks(static_cast<size_t>(blockCols) * blockRows, 0);
+		TileScheduler::rowBands(blockSize).run(srcImg.size(), cv::Size(0, 0), [&](const Tile& tile) {
+			auto dirtyRow = dirtyBlocks.data() + static_cast<size_t>(tile.rect.y / blockSize) * blockCols;
+
+			for (int imgY = tile.rect.y; imgY < tile.rect.y + tile.rect.height; imgY++) {
+				auto srcRow = srcImg.ptr<uchar>(imgY);
+				auto prevRow = prevSrcImg.ptr<uchar>(imgY);
+
+				for (int blockX = 0; blockX < blockCols; blockX++) {
+					if (dirtyRow[blockX]) {
+						continue;
+					}
+
+					const int startX = blockX * blockSize;
+					const int width = std::min(blockSize, srcImg.cols - startX);
+					if (std::memcmp(srcRow + startX * elemSize, prevRow + startX * elemSize, width * elemSize) != 0) {
+						dirtyRow[blockX] = 1;
+					}
+				}
+			}
+		});
+
+		// Runs of dirty blocks along each block row, grown by the reach.
+		std::vector<cv::Rect> dirtyRects;
+		for (int blockY = 0; blockY < blockRows; blockY++) {
+			auto dirtyRow = dirtyBlocks.data() + static_cast<size_t>(blockY) * blockCols;
+
+			for (int blockX = 0; blockX < blockCols; blockX++) {
+				if (!dirtyRow[blockX]) {
+					continue;
+				}
+
+				const int startBlockX = blockX;
+				while (blockX + 1 < blockCols && dirtyRow[blockX + 1]) {
+					blockX++;
+				}
+
+				const cv::Rect blockRect(startBlockX * blockSize, blockY * blockSize, (blockX - startBlockX + 1) * blockSize, blockSize);
+				dirtyRects.push_back(grow(blockRect, srcImg.size()));
+			}
+		}
+
+		bool merged = true;
+		while (merged) {
+			merged = false;
+			for (size_t i = 0; i < dirtyRects.size() && !merged; i++) {
+				for (size_t j = i + 1; j < dirtyRects.size(); j++) {
+					if ((dirtyRects[i] & dirtyRects[j]).area() > 0) {
+						dirtyRects[i] |= dirtyRects[j];
+						dirtyRects.erase(dirtyRects.begin() + j);
+						merged = true;
+						break;
+					}
+				}
+			}
+		}
+
+		return dirtyRects;
+	}
+};
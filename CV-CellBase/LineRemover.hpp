@@ -1,37 +1,60 @@
+#pragma once
+#include <climits>
+#include <tuple>
+
 #include "Filter.hpp"
+#include "ColorMatch.hpp"
+
+#if defined(_MSC_VER)
+#define CELLBASE_FORCEINLINE __forceinline
+#else
+#define CELLBASE_FORCEINLINE inline __attribute__((always_inline))
+#endif
+
+enum class LineRemoverEngine {
+	Iterative, // one sweep over the remaining line pixels per step
+	Wavefront, // breadth-first from the line boundary, linear in the number of line pixels
+};
 
 template <typename T, typename U>
 class LineRemover : public Filter {
 	std::vector<cv::Vec<U, 4>> lineColors; // {B, G, R, Tolerance}
 	std::vector<cv::Vec<U, 4>> excludedColors; // {B, G, R, Tolerance}
 	int maxTimes;
+	LineRemoverEngine engine;
 
-	std::vector<cv::Point> collectLinePositions(cv::Mat_<T> srcImg) {
-		const int pixelCount = srcImg.cols * srcImg.rows;
-
-		std::vector<cv::Point> linePositions;
-		linePositions.reserve(pixelCount);
-
-		auto pixels = reinterpret_cast<T*>(srcImg.data);
-		int i = 0;
-		for (int imgY = 0; imgY < srcImg.rows; imgY++) {
-			for (int imgX = 0; imgX < srcImg.cols; imgX++) {
-				const T srcColor = pixels[i++];
-				for (const auto& lineColor : lineColors) {
-					if (std::abs(srcColor[0] - lineColor[0]) <= lineColor[3] &&
-						std::abs(srcColor[1] - lineColor[1]) <= lineColor[3] &&
-						std::abs(srcColor[2] - lineColor[2]) <= lineColor[3]) {
-						linePositions.emplace_back(imgX, imgY);
-						break;
-					}
-				}
-			}
+	static constexpr uchar excludedClass = 1;
+	static constexpr uchar lineClass = 2;
+	ColorClassifier classifier; // 8-bit colors only
+
+	static bool matches(const T& color, const cv::Vec<U, 4>& rule) {
+		return std::abs(color[0] - rule[0]) <= rule[3] &&
+			std::abs(color[1] - rule[1]) <= rule[3] &&
+			std::abs(color[2] - rule[2]) <= rule[3];
+	}
+
+	// Bitmask of excludedClass and lineClass.
+	uchar classifyColor(const T& color) const {
+		if constexpr (std::is_same_v<U, uchar>) {
+			return classifier.classify(color);
 		}
+		else {
+			const bool isExcluded = std::any_of(excludedColors.begin(), excludedColors.end(), [&](const cv::Vec<U, 4>& rule) { return matches(color, rule); });
+			const bool isLine = std::any_of(lineColors.begin(), lineColors.end(), [&](const cv::Vec<U, 4>& rule) { return matches(color, rule); });
+			return (isExcluded ? excludedClass : 0) | (isLine ? lineClass : 0);
+		}
+	}
 
-		return linePositions;
+	// Line pixels as imgY * cols + imgX, in raster order.
+	std::vector<int> collectLinePositions(const cv::Mat_<T>& srcImg) {
+		return ColorMatcher<T, U>(lineColors).match(srcImg).indices();
 	}
 
-	__forceinline bool __replaceColor(const cv::Mat_<T>& srcImg, cv::Mat_<T>& dstImg, const cv::Point& position, const std::vector<cv::Vec<U, 4>>& excludedColors, const int kernelY, const int kernelX) {
+	static cv::Point toPoint(int pixelIndex, int cols) {
+		return cv::Point(pixelIndex % cols, pixelIndex / cols);
+	}
+
+	CELLBASE_FORCEINLINE bool __replaceColor(const cv::Mat_<T>& srcImg, cv::Mat_<T>& dstImg, const cv::Point& position, const int kernelY, const int kernelX) {
 		const int sampleY = position.y + kernelY;
 		const int sampleX = position.x + kernelX;
 		if (sampleY < 0 || srcImg.rows <= sampleY || sampleX < 0 || srcImg.cols <= sampleX) {
@@ -39,13 +62,8 @@ class LineRemover : public Filter {
 		}
 
 		const T srcColor = srcImg(sampleY, sampleX);
-
-		for (const auto& excludedColor : excludedColors) {
-			if (std::abs(srcColor[0] - excludedColor[0]) <= excludedColor[3] &&
-				std::abs(srcColor[1] - excludedColor[1]) <= excludedColor[3] &&
-				std::abs(srcColor[2] - excludedColor[2]) <= excludedColor[3]) {
-				return false;
-			}
+		if (classifyColor(srcColor) != 0) {
+			return false;
 		}
 
 		dstImg(position) = srcColor;
@@ -54,14 +72,14 @@ class LineRemover : public Filter {
 
 	}
 
-	__forceinline bool replaceColor(const cv::Mat_<T>& srcImg, cv::Mat_<T>& dstImg, const cv::Point& position, const std::vector<cv::Vec<U, 4>>& excludedColors) {
+	CELLBASE_FORCEINLINE bool replaceColor(const cv::Mat_<T>& srcImg, cv::Mat_<T>& dstImg, const cv::Point& position) {
 		for (int kernelY = -1; kernelY <= 1; kernelY++) {
 			for (int kernelX = -1; kernelX <= 1; kernelX++) {
 				if (kernelY == 0 && kernelX == 0) {
 					continue;
 				}
 
-				bool isReplaced = __replaceColor(srcImg, dstImg, position, excludedColors, kernelY, kernelX);
+				bool isReplaced = __replaceColor(srcImg, dstImg, position, kernelY, kernelX);
 				if (isReplaced) {
 					return true;
 				}
@@ -71,30 +89,33 @@ class LineRemover : public Filter {
 		return false;
 	}
 
-	std::vector<cv::Point> _apply(const cv::Mat_<T>& srcImg, cv::Mat_<T>& dstImg, const std::vector<cv::Point>& linePositions) {
-		std::vector<cv::Vec<U, 4>> excludedColors = this->excludedColors;
-		excludedColors.insert(excludedColors.end(), lineColors.begin(), lineColors.end());
-
-		std::vector<cv::Point> newLinePositions;
-		newLinePositions.reserve(linePositions.size());
+	std::vector<int> _apply(const cv::Mat_<T>& srcImg, cv::Mat_<T>& dstImg, const std::vector<int>& linePositions) {
+		// Every position reads srcImg and writes only its own pixel of dstImg, so chunks are independent.
+		constexpr int grainSize = 4096;
+		const int positionCount = static_cast<int>(linePositions.size());
+		std::vector<std::vector<int>> chunkLinePositions((positionCount + grainSize - 1) / grainSize);
 
-		for (const auto& linePosition : linePositions) {
-			bool isReplaced = replaceColor(srcImg, dstImg, linePosition, excludedColors);
-			if (isReplaced == false) {
-				newLinePositions.push_back(linePosition);
+		scheduler.runRange(positionCount, grainSize, [&](const cv::Range& range) {
+			auto& newLinePositions = chunkLinePositions[range.start / grainSize];
+			for (int i = range.start; i < range.end; i++) {
+				bool isReplaced = replaceColor(srcImg, dstImg, toPoint(linePositions[i], srcImg.cols));
+				if (isReplaced == false) {
+					newLinePositions.push_back(linePositions[i]);
+				}
 			}
+		});
+
+		std::vector<int> newLinePositions;
+		newLinePositions.reserve(linePositions.size());
+		for (const auto& chunk : chunkLinePositions) {
+			newLinePositions.insert(newLinePositions.end(), chunk.begin(), chunk.end());
 		}
 
 		return newLinePositions;
 	}
 
-public:
-	LineRemover(std::vector<cv::Vec<U, 4>> _lineColors, std::vector<cv::Vec<U, 4>> _excludedColors, int _maxTimes) : lineColors(_lineColors), excludedColors(_excludedColors), maxTimes(_maxTimes) {}
-
-	cv::Mat apply(cv::Mat _srcImg) {
-		cv::Mat_<T> srcImg = _srcImg;
-		cv::Mat_<T> dstImg = srcImg.clone();
-		auto linePositions = collectLinePositions(srcImg);
+	cv::Mat_<T> applyIterative(cv::Mat_<T> srcImg, std::vector<int> linePositions) {
+		cv::Mat_<T> dstImg = BufferPool::shared().clone(srcImg);
 
 		for (int i = 0; i < maxTimes; i++) {
 			auto newLinePositions = _apply(srcImg, dstImg, linePositions);
@@ -102,15 +123,157 @@ public:
 				break;
 			}
 
-			for (const auto& oldLinePosition : linePositions) {
-				srcImg(oldLinePosition) = dstImg(oldLinePosition);
-			}
+			scheduler.runRange(static_cast<int>(linePositions.size()), 4096, [&](const cv::Range& range) {
+				for (int i = range.start; i < range.end; i++) {
+					const auto position = toPoint(linePositions[i], srcImg.cols);
+					srcImg(position) = dstImg(position);
+				}
+			});
 
 			linePositions = std::move(newLinePositions);
 		}
 
 		return dstImg;
 	}
+
+	// Same result as applyIterative. A line pixel the iterative engine replaces in step n has level
+	// n: 1 if a neighbor is a non-line pixel of a usable color, else 1 + the lowest level among its
+	// line neighbors. Levels are found wave by wave from the line boundary, and each pixel takes the
+	// color of its first neighbor, in replaceColor's order, that was usable before its own step.
+	cv::Mat_<T> applyWavefront(const cv::Mat_<T>& srcImg, const std::vector<int>& linePositions) {
+		cv::Mat_<T> dstImg = BufferPool::shared().clone(srcImg);
+
+		// levelImg: > 0 level of a replaced line pixel, 0 usable non-line pixel.
+		constexpr int unreached = -1; // line pixel not replaced (yet)
+		constexpr int unknown = -2; // non-line pixel not looked at yet
+		constexpr int excluded = INT_MAX; // non-line pixel of an excluded color
+		cv::Mat_<int> levelImg = BufferPool::shared().acquire(srcImg.size(), CV_32SC1, unknown);
+		for (const auto pixelIndex : linePositions) {
+			levelImg(toPoint(pixelIndex, srcImg.cols)) = unreached;
+		}
+
+		auto levelAt = [&](int sampleY, int sampleX) {
+			int& level = levelImg(sampleY, sampleX);
+			if (level == unknown) {
+				const bool isExcluded = classifyColor(srcImg(sampleY, sampleX)) & excludedClass;
+				level = isExcluded ? excluded : 0;
+			}
+			return level;
+		};
+
+		// Colors position from its first neighbor below level, or returns false if there is none.
+		auto replace = [&](int pixelIndex, int level) {
+			const auto position = toPoint(pixelIndex, srcImg.cols);
+			for (int kernelY = -1; kernelY <= 1; kernelY++) {
+				for (int kernelX = -1; kernelX <= 1; kernelX++) {
+					const int sampleY = position.y + kernelY;
+					const int sampleX = position.x + kernelX;
+					if ((kernelY == 0 && kernelX == 0) || sampleY < 0 || srcImg.rows <= sampleY || sampleX < 0 || srcImg.cols <= sampleX) {
+						continue;
+					}
+
+					const int sampleLevel = levelAt(sampleY, sampleX);
+					if (0 <= sampleLevel && sampleLevel < level) {
+						dstImg(position) = dstImg(sampleY, sampleX);
+						return true;
+					}
+				}
+			}
+			return false;
+		};
+
+		std::vector<int> wave;
+		if (maxTimes < 1) {
+			return dstImg;
+		}
+
+		for (const auto pixelIndex : linePositions) {
+			if (replace(pixelIndex, 1)) {
+				wave.push_back(pixelIndex);
+			}
+		}
+		for (const auto pixelIndex : wave) {
+			levelImg(toPoint(pixelIndex, srcImg.cols)) = 1;
+		}
+
+		std::vector<int> nextWave;
+		for (int level = 2; level <= maxTimes && !wave.empty(); level++) {
+			nextWave.clear();
+			for (const auto pixelIndex : wave) {
+				const auto position = toPoint(pixelIndex, srcImg.cols);
+				for (int kernelY = -1; kernelY <= 1; kernelY++) {
+					for (int kernelX = -1; kernelX <= 1; kernelX++) {
+						const int sampleY = position.y + kernelY;
+						const int sampleX = position.x + kernelX;
+						if (sampleY < 0 || srcImg.rows <= sampleY || sampleX < 0 || srcImg.cols <= sampleX) {
+							continue;
+						}
+
+						if (levelImg(sampleY, sampleX) == unreached) {
+							levelImg(sampleY, sampleX) = level;
+							nextWave.push_back(sampleY * srcImg.cols + sampleX);
+						}
+					}
+				}
+			}
+
+			// Every pixel of the wave has a neighbor one level down, the one that reached it.
+			for (const auto pixelIndex : nextWave) {
+				replace(pixelIndex, level);
+			}
+
+			std::swap(wave, nextWave);
+		}
+
+		return dstImg;
+	}
+
+public:
+	cv::Size halo() const {
+		return cv::Size(maxTimes, maxTimes);
+	}
+
+	bool isLocal() const {
+		return true;
+	}
+
+	std::string signature() const {
+		std::ostringstream stream;
+		stream << "LineRemover<" << typeid(T).name() << ">(";
+		for (const auto& color : lineColors) {
+			stream << color << ",";
+		}
+		stream << ";";
+		for (const auto& color : excludedColors) {
+			stream << color << ",";
+		}
+		stream << ";" << maxTimes << ")";
+		return stream.str();
+	}
+
+	LineRemover(std::vector<cv::Vec<U, 4>> _lineColors, std::vector<cv::Vec<U, 4>> _excludedColors, int _maxTimes, LineRemoverEngine _engine = LineRemoverEngine::Wavefront) : lineColors(_lineColors), excludedColors(_excludedColors), maxTimes(_maxTimes), engine(_engine) {
+		if constexpr (std::is_same_v<U, uchar>) {
+			std::vector<ColorRule> rules;
+			for (const auto& color : excludedColors) {
+				rules.push_back(ColorRule{ cv::Vec3b(color[0], color[1], color[2]), color[3], 0 });
+			}
+			for (const auto& color : lineColors) {
+				rules.push_back(ColorRule{ cv::Vec3b(color[0], color[1], color[2]), color[3], 1 });
+			}
+			classifier = ColorClassifier(rules);
+		}
+	}
+
+	cv::Mat apply(cv::Mat _srcImg) {
+		CV_Assert(_srcImg.type() == cv::traits::Type<T>::value);
+		cv::Mat_<T> srcImg = BufferPool::shared().clone(_srcImg);
+		auto linePositions = collectLinePositions(srcImg);
+
+		if (engine == LineRemoverEngine::Iterative) {
+			return applyIterative(srcImg, std::move(linePositions));
+		}
+		return applyWavefront(srcImg, linePositions);
+	}
 };
 
 using LineRemover3b = LineRemover<cv::Vec3b, uchar>;
@@ -120,3 +283,52 @@ using LineRemover4b = LineRemover<cv::Vec4b, uchar>;
 using LineRemover4w = LineRemover<cv::Vec4w, ushort>;
 using LineRemover4f = LineRemover<cv::Vec4f, float>;
 
+// A LineRemover for each pixel type, applying the one matching the source. Colors and tolerances are
+// given in 8 bits and scaled to the sample depth, so one recipe runs on 8-bit, 16-bit and float plates.
+class AnyLineRemover : public Filter {
+public:
+	AnyLineRemover(const std::vector<cv::Vec4b>& lineColors, const std::vector<cv::Vec4b>& excludedColors, int maxTimes, LineRemoverEngine engine = LineRemoverEngine::Wavefront)
+		: removers(make<cv::Vec3b>(lineColors, excludedColors, maxTimes, engine), make<cv::Vec4b>(lineColors, excludedColors, maxTimes, engine),
+			make<cv::Vec3w>(lineColors, excludedColors, maxTimes, engine), make<cv::Vec4w>(lineColors, excludedColors, maxTimes, engine),
+			make<cv::Vec3f>(lineColors, excludedColors, maxTimes, engine), make<cv::Vec4f>(lineColors, excludedColors, maxTimes, engine)) {}
+
+	cv::Size halo() const {
+		return std::get<0>(removers).halo();
+	}
+
+	bool isLocal() const {
+		return true;
+	}
+
+	// The 8-bit remover's signature stands for all of them, as they share the 8-bit rules.
+	std::string signature() const {
+		return "Any" + std::get<0>(removers).signature();
+	}
+
+	cv::Mat apply(cv::Mat srcImg) {
+		return dispatchPixelType(srcImg.type(), [&]<typename T>(T) {
+			return std::get<LineRemover<T, typename T::value_type>>(removers).apply(srcImg);
+		});
+	}
+
+private:
+	std::tuple<LineRemover3b, LineRemover4b, LineRemover3w, LineRemover4w, LineRemover3f, LineRemover4f> removers;
+
+	template<typename T>
+	static LineRemover<T, typename T::value_type> make(const std::vector<cv::Vec4b>& lineColors, const std::vector<cv::Vec4b>& excludedColors, int maxTimes, LineRemoverEngine engine) {
+		return LineRemover<T, typename T::value_type>(scaleRules<typename T::value_type>(lineColors), scaleRules<typename T::value_type>(excludedColors), maxTimes, engine);
+	}
+
+	template<typename U>
+	static std::vector<cv::Vec<U, 4>> scaleRules(const std::vector<cv::Vec4b>& rules) {
+		std::vector<cv::Vec<U, 4>> scaledRules;
+		for (const auto& rule : rules) {
+			cv::Vec<U, 4> scaledRule;
+			for (int c = 0; c < 4; c++) {
+				scaledRule[c] = static_cast<U>(rule[c] * (whiteSample<U>() / 255.0));
+			}
+			scaledRules.push_back(scaledRule);
+		}
+		return scaledRules;
+	}
+};
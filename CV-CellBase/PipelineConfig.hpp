@@ -0,0 +1,372 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "Filter.hpp"
+#include "CellBlur.hpp"
+#include "ChalkFilter.hpp"
+#include "FilterGraph.hpp"
+#include "LineRemover.hpp"
+
+// A FilterGraph described in a cv::FileStorage file (YAML, JSON or XML), so recipes can change
+// without a rebuild:
+//
+//   colors:                      # named BGR color lists
+//     hair: [ [41, 38, 40], [97, 57, 70] ]
+//   nodes:                       # in order; inputs name earlier nodes or "source"
+//     - { name: blurred, input: source, filters: [ { type: CellBlur, sigma: 20, size: 21, targets: [ hair ] } ] }
+//     - { name: lines, input: source, filters: [ { type: LineOnly } ] }
+//     - { name: cell, composite: compositeLayers, inputs: [ blurred, lines ], alphas: [ 0.3 ] }
+//   output: cell
+//
+// Filter keys follow the constructor parameters, except for Choke, whose radius is the erosion in
+// pixels: { type: Choke, radius: 2 } is Choke(4).
+// The whole description is checked when loaded, and errors name the node and key at fault.
+// graph() then builds a fresh graph with its own filters, one per worker.
+class PipelineConfig {
+public:
+	std::string outputName;
+
+	static PipelineConfig load(const std::string& path) {
+		cv::FileStorage storage(path, cv::FileStorage::READ);
+		if (!storage.isOpened()) {
+			CV_Error(cv::Error::StsBadArg, "cannot read pipeline config " + path);
+		}
+		return PipelineConfig(storage.root());
+	}
+
+	PipelineConfig(const cv::FileNode& root) {
+		const auto colorsNode = root["colors"];
+		if (!colorsNode.empty()) {
+			if (!colorsNode.isMap()) {
+				fail("colors", "must map names to color lists");
+			}
+			for (const auto& name : colorsNode.keys()) {
+				colorLists[name] = readColors(colorsNode[name], "colors." + name);
+			}
+		}
+
+		const auto nodesNode = root["nodes"];
+		if (!nodesNode.isSeq() || nodesNode.size() == 0) {
+			fail("nodes", "must be a non-empty list");
+		}
+		for (const auto& nodeNode : nodesNode) {
+			readNode(nodeNode);
+		}
+
+		outputName = readString(root, "output", "");
+		const auto output = nodeIndices.find(outputName);
+		if (output == nodeIndices.end()) {
+			fail("output", "no node named \"" + outputName + "\"");
+		}
+		outputNode = output->second;
+
+		// Filter constructors check their own arguments.
+		graph();
+	}
+
+	FilterGraph graph() const {
+		FilterGraph graph;
+		std::vector<FilterGraph::Node> graphNodes;
+		for (const auto& node : nodes) {
+			std::vector<FilterGraph::Node> inputs;
+			for (const auto input : node.inputs) {
+				inputs.push_back(input == sourceIndex ? FilterGraph::source : graphNodes[input]);
+			}
+
+			if (node.composite) {
+				graphNodes.push_back(node.composite(graph, inputs));
+			}
+			else {
+				auto graphNode = inputs[0];
+				for (const auto& makeFilter : node.filters) {
+					graphNode = graph.add(graphNode, makeFilter());
+				}
+				graphNodes.push_back(graphNode);
+			}
+		}
+
+		graph.setOutput(outputName, graphNodes[outputNode]);
+		return graph;
+	}
+
+private:
+	static constexpr int sourceIndex = -1;
+
+	struct NodeSpec {
+		std::vector<int> inputs; // indices of earlier nodes, or sourceIndex
+		std::vector<std::function<std::shared_ptr<Filter>()>> filters;
+		std::function<FilterGraph::Node(FilterGraph&, const std::vector<FilterGraph::Node>&)> composite;
+		bool isGray = false; // ends with a ChalkFilter, whose output is one channel
+	};
+
+	std::map<std::string, std::vector<cv::Vec3b>> colorLists;
+	std::map<std::string, int> nodeIndices;
+	std::vector<NodeSpec> nodes;
+	int outputNode = 0;
+
+	[[noreturn]] static void fail(const std::string& context, const std::string& message) {
+		CV_Error(cv::Error::StsBadArg, "pipeline config: " + context + ": " + message);
+	}
+
+	static double readNumber(const cv::FileNode& parent, const std::string& key, const std::string& context) {
+		const auto node = parent[key];
+		if (node.empty()) {
+			fail(context, "missing \"" + key + "\"");
+		}
+		if (!node.isInt() && !node.isReal()) {
+			fail(context + "." + key, "must be a number");
+		}
+		return node.real();
+	}
+
+	static double readNumber(const cv::FileNode& parent, const std::string& key, const std::string& context, double defaultValue) {
+		return parent[key].empty() ? defaultValue : readNumber(parent, key, context);
+	}
+
+	static int readInt(const cv::FileNode& parent, const std::string& key, const std::string& context, int minValue) {
+		const double value = readNumber(parent, key, context);
+		if (value != static_cast<int>(value) || value < minValue) {
+			fail(context + "." + key, "must be an integer of at least " + std::to_string(minValue));
+		}
+		return static_cast<int>(value);
+	}
+
+	static std::string readString(const cv::FileNode& parent, const std::string& key, const std::string& context) {
+		const auto node = parent[key];
+		if (!node.isString()) {
+			fail(context.empty() ? key : context + "." + key, "must be a string");
+		}
+		return node.string();
+	}
+
+	// [B, G, R] or, with withTolerance, [B, G, R, tolerance]; every value 0 to 255.
+	static cv::Vec4b readColor(const cv::FileNode& node, const std::string& context, bool withTolerance) {
+		const size_t channels = withTolerance ? 4 : 3;
+		if (!node.isSeq() || node.size() != channels) {
+			fail(context, withTolerance ? "colors must be [B, G, R, tolerance]" : "colors must be [B, G, R]");
+		}
+
+		cv::Vec4b color(0, 0, 0, 0);
+		for (size_t c = 0; c < channels; c++) {
+			const auto value = node[static_cast<int>(c)];
+			if (!value.isInt() || static_cast<int>(value) < 0 || 255 < static_cast<int>(value)) {
+				fail(context, "color values must be integers from 0 to 255");
+			}
+			color[static_cast<int>(c)] = static_cast<uchar>(static_cast<int>(value));
+		}
+		return color;
+	}
+
+	static std::vector<cv::Vec3b> readColors(const cv::FileNode& node, const std::string& context) {
+		if (!node.isSeq()) {
+			fail(context, "must be a list of colors");
+		}
+
+		std::vector<cv::Vec3b> colors;
+		for (const auto& colorNode : node) {
+			const auto color = readColor(colorNode, context, false);
+			colors.push_back(cv::Vec3b(color[0], color[1], color[2]));
+		}
+		return colors;
+	}
+
+	static std::vector<cv::Vec4b> readColorRules(const cv::FileNode& parent, const std::string& key, const std::string& context) {
+		const auto node = parent[key];
+		if (!node.isSeq()) {
+			fail(context + "." + key, "must be a list of [B, G, R, tolerance]");
+		}
+
+		std::vector<cv::Vec4b> rules;
+		for (const auto& ruleNode : node) {
+			rules.push_back(readColor(ruleNode, context + "." + key, true));
+		}
+		return rules;
+	}
+
+	// Each target is the name of a list under colors, or a list of colors.
+	std::vector<std::vector<cv::Vec3b>> readTargets(const cv::FileNode& parent, const std::string& context) const {
+		const auto node = parent["targets"];
+		if (!node.isSeq() || node.size() == 0) {
+			fail(context + ".targets", "must be a non-empty list of color lists");
+		}
+
+		std::vector<std::vector<cv::Vec3b>> targets;
+		for (const auto& targetNode : node) {
+			if (targetNode.isString()) {
+				const auto found = colorLists.find(targetNode.string());
+				if (found == colorLists.end()) {
+					fail(context + ".targets", "no color list named \"" + targetNode.string() + "\"");
+				}
+				targets.push_back(found->second);
+			}
+			else {
+				targets.push_back(readColors(targetNode, context + ".targets"));
+			}
+		}
+		return targets;
+	}
+
+	std::function<std::shared_ptr<Filter>()> readFilter(const cv::FileNode& node, const std::string& context) const {
+		if (!node.isMap()) {
+			fail(context, "filters must be maps with a type");
+		}
+
+		const auto type = readString(node, "type", context);
+		if (type == "AveragingBlur") {
+			const int width = readInt(node, "width", context, 1);
+			const int height = readInt(node, "height", context, 1);
+			return [=] { return std::make_shared<AveragingBlur>(width, height); };
+		}
+		if (type == "GaussianBlur") {
+			const auto sigma = static_cast<float>(readNumber(node, "sigma", context));
+			const int size = readInt(node, "size", context, 1);
+			if (sigma <= 0.0f) {
+				fail(context + ".sigma", "must be positive");
+			}
+			return [=] { return std::make_shared<::GaussianBlur>(sigma, size); };
+		}
+		if (type == "SobelX") {
+			return [] { return std::make_shared<SobelX>(); };
+		}
+		if (type == "SobelY") {
+			return [] { return std::make_shared<SobelY>(); };
+		}
+		if (type == "SobelAbsXY") {
+			return [] { return std::make_shared<SobelAbsXY>(); };
+		}
+		if (type == "LineOnly") {
+			return [] { return std::make_shared<LineOnly>(); };
+		}
+		if (type == "Choke") {
+			const int radius = readInt(node, "radius", context, 0);
+			return [=] { return std::make_shared<Choke>(2 * radius); };
+		}
+		if (type == "CellBlur") {
+			const auto sigma = static_cast<float>(readNumber(node, "sigma", context));
+			const int size = readInt(node, "size", context, 1);
+			const auto targets = readTargets(node, context);
+			if (sigma <= 0.0f) {
+				fail(context + ".sigma", "must be positive");
+			}
+			return [=] { return std::make_shared<::CellBlur>(sigma, size, targets); };
+		}
+		if (type == "LineRemover") {
+			const auto lineColors = readColorRules(node, "lineColors", context);
+			const auto excludedColors = readColorRules(node, "excludedColors", context);
+			const int maxTimes = readInt(node, "maxTimes", context, 0);
+			return [=] { return std::make_shared<AnyLineRemover>(lineColors, excludedColors, maxTimes); };
+		}
+		if (type == "ChalkFilter") {
+			const auto seed = static_cast<uint64_t>(readNumber(node, "seed", context, 0.0));
+			const double noiseMean = readNumber(node, "noiseMean", context, ChalkFilter().noiseMean);
+			const double noiseSigma = readNumber(node, "noiseSigma", context, ChalkFilter().noiseSigma);
+			return [=] {
+				auto filter = std::make_shared<ChalkFilter>(seed);
+				filter->noiseMean = noiseMean;
+				filter->noiseSigma = noiseSigma;
+				return filter;
+			};
+		}
+
+		fail(context + ".type", "unknown filter \"" + type + "\"");
+	}
+
+	int readInput(const cv::FileNode& node, const std::string& context) const {
+		if (!node.isString()) {
+			fail(context, "inputs must be node names");
+		}
+
+		const auto name = node.string();
+		if (name == "source") {
+			return sourceIndex;
+		}
+		const auto found = nodeIndices.find(name);
+		if (found == nodeIndices.end()) {
+			fail(context, "no earlier node named \"" + name + "\"");
+		}
+		return found->second;
+	}
+
+	void readNode(const cv::FileNode& node) {
+		const auto name = readString(node, "name", "nodes[" + std::to_string(nodes.size()) + "]");
+		const auto context = "node " + name;
+		if (name == "source" || nodeIndices.count(name) != 0) {
+			fail(context, "names must be unique and not \"source\"");
+		}
+
+		// Every filter and composite but ChalkFilter takes 3 or 4 channels, so a one-channel
+		// ChalkFilter output can only be a final result.
+		auto checkColorInput = [&](int input, const std::string& inputContext) {
+			if (input != sourceIndex && nodes[input].isGray) {
+				fail(inputContext, "a node ending with a ChalkFilter has one channel and cannot be filtered further or composited");
+			}
+		};
+
+		NodeSpec spec;
+		if (node["composite"].empty()) {
+			spec.inputs.push_back(readInput(node["input"], context + ".input"));
+			checkColorInput(spec.inputs[0], context + ".input");
+
+			const auto filtersNode = node["filters"];
+			if (!filtersNode.isSeq() || filtersNode.size() == 0) {
+				fail(context + ".filters", "must be a non-empty list");
+			}
+			for (const auto& filterNode : filtersNode) {
+				const auto filterContext = context + ".filters[" + std::to_string(spec.filters.size()) + "]";
+				if (spec.isGray) {
+					fail(filterContext, "a ChalkFilter has one channel and must be the last filter of its node");
+				}
+				spec.filters.push_back(readFilter(filterNode, filterContext));
+				spec.isGray = readString(filterNode, "type", filterContext) == "ChalkFilter";
+			}
+		}
+		else {
+			const auto inputsNode = node["inputs"];
+			if (!inputsNode.isSeq() || inputsNode.size() < 2) {
+				fail(context + ".inputs", "composites need a list of at least 2 inputs");
+			}
+			for (const auto& inputNode : inputsNode) {
+				spec.inputs.push_back(readInput(inputNode, context + ".inputs"));
+				checkColorInput(spec.inputs.back(), context + ".inputs");
+			}
+
+			const auto composite = readString(node, "composite", context);
+			if (composite == "compositeLayers") {
+				const auto alphasNode = node["alphas"];
+				if (!alphasNode.isSeq() || alphasNode.size() + 1 != spec.inputs.size()) {
+					fail(context + ".alphas", "needs one opacity per input after the first");
+				}
+				std::vector<double> alphas;
+				for (const auto& alphaNode : alphasNode) {
+					if (!alphaNode.isInt() && !alphaNode.isReal()) {
+						fail(context + ".alphas", "must be numbers");
+					}
+					alphas.push_back(alphaNode.real());
+				}
+				spec.composite = [alphas](FilterGraph& graph, const std::vector<FilterGraph::Node>& inputs) { return graph.compositeLayers(inputs, alphas); };
+			}
+			else if (composite == "layers") {
+				spec.composite = [](FilterGraph& graph, const std::vector<FilterGraph::Node>& inputs) { return graph.layers(inputs); };
+			}
+			else if (composite == "layersWithAlpha") {
+				if (spec.inputs.size() != 2) {
+					fail(context + ".inputs", "layersWithAlpha takes [bg, fg]");
+				}
+				const double alpha = readNumber(node, "alpha", context);
+				spec.composite = [alpha](FilterGraph& graph, const std::vector<FilterGraph::Node>& inputs) { return graph.layersWithAlpha(inputs[0], inputs[1], alpha); };
+			}
+			else {
+				fail(context + ".composite", "unknown composite \"" + composite + "\"");
+			}
+		}
+
+		nodeIndices[name] = static_cast<int>(nodes.size());
+		nodes.push_back(spec);
+	}
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <limits>
+#include <type_traits>
+
+#include <opencv2/opencv.hpp>
+
+// Filters run on 3 or 4 channels of 8-bit, 16-bit or float samples. Each switches on the image
+// type once, with dispatchPixelType, and runs loops templated on the pixel type, as LineRemover is.
+// The first 3 channels are B, G, R; a fourth is alpha.
+
+// Sample value of full intensity: 255, 65535 or 1.0f.
+template<typename S>
+constexpr S whiteSample() {
+	if constexpr (std::is_floating_point_v<S>) {
+		return S(1);
+	}
+	else {
+		return std::numeric_limits<S>::max();
+	}
+}
+
+// White and fully opaque.
+template<typename T>
+T whitePixel() {
+	T pixel;
+	for (int c = 0; c < T::channels; c++) {
+		pixel[c] = whiteSample<typename T::value_type>();
+	}
+	return pixel;
+}
+
+// Tested at the pixel's own depth, so a 16-bit or float sample just below full intensity is not white.
+template<typename T>
+bool isWhite(const T& pixel) {
+	return pixel == whitePixel<T>();
+}
+
+// Nearest 8-bit color of the first 3 channels.
+template<typename T>
+cv::Vec3b toColor8(const T& pixel) {
+	using Sample = typename T::value_type;
+	if constexpr (std::is_same_v<Sample, uchar>) {
+		return cv::Vec3b(pixel[0], pixel[1], pixel[2]);
+	}
+	else {
+		constexpr float scale = 255.0f / whiteSample<Sample>();
+		return cv::Vec3b(cv::saturate_cast<uchar>(pixel[0] * scale), cv::saturate_cast<uchar>(pixel[1] * scale), cv::saturate_cast<uchar>(pixel[2] * scale));
+	}
+}
+
+// Calls fn(T()) with the pixel type T of type: cv::Vec3b, Vec4b, Vec3w, Vec4w, Vec3f or Vec4f.
+template<typename Fn>
+decltype(auto) dispatchPixelType(int type, Fn&& fn) {
+	switch (type) {
+	case CV_8UC3:
+		return fn(cv::Vec3b());
+	case CV_8UC4:
+		return fn(cv::Vec4b());
+	case CV_16UC3:
+		return fn(cv::Vec3w());
+	case CV_16UC4:
+		return fn(cv::Vec4w());
+	case CV_32FC3:
+		return fn(cv::Vec3f());
+	case CV_32FC4:
+		return fn(cv::Vec4f());
+	default:
+		CV_Error(cv::Error::StsUnsupportedFormat, "pixel type must be 3 or 4 channels of 8U, 16U or 32F");
+	}
+}
@@ -0,0 +1,261 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CELLBASE_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CELLBASE_SIMD_SSE2
+#endif
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+// Thin float / int16 vector wrappers so kernels are written once for AVX2, SSE2 and plain scalar builds.
+namespace simd {
+
+#if defined(CELLBASE_SIMD_AVX2)
+
+struct f32 {
+	__m256 v;
+	static constexpr int lanes = 8;
+};
+
+inline f32 zero() { return { _mm256_setzero_ps() }; }
+inline f32 set1(float x) { return { _mm256_set1_ps(x) }; }
+inline f32 load(const float* src) { return { _mm256_loadu_ps(src) }; }
+inline void store(float* dst, f32 a) { _mm256_storeu_ps(dst, a.v); }
+inline f32 add(f32 a, f32 b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline f32 sub(f32 a, f32 b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline f32 mul(f32 a, f32 b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline f32 min(f32 a, f32 b) { return { _mm256_min_ps(a.v, b.v) }; }
+inline f32 max(f32 a, f32 b) { return { _mm256_max_ps(a.v, b.v) }; }
+
+inline f32 loadI32(const int32_t* src) { return { _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src))) }; }
+
+inline f32 loadU8(const uint8_t* src) {
+	__m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src));
+	return { _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes)) };
+}
+
+// Rounds half to even and saturates, same as cv::saturate_cast<uchar>(float).
+inline void storeU8(uint8_t* dst, f32 a) {
+	__m256i i32 = _mm256_cvtps_epi32(a.v);
+	__m128i i16 = _mm_packs_epi32(_mm256_castsi256_si128(i32), _mm256_extracti128_si256(i32, 1));
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packus_epi16(i16, i16));
+}
+
+inline f32 loadU16(const uint16_t* src) { return { _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)))) }; }
+
+// Same rounding and saturation as cv::saturate_cast<ushort>(float).
+inline void storeU16(uint16_t* dst, f32 a) {
+	__m256i i32 = _mm256_cvtps_epi32(a.v);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_packus_epi32(_mm256_castsi256_si128(i32), _mm256_extracti128_si256(i32, 1)));
+}
+
+struct i16 {
+	__m256i v;
+	static constexpr int lanes = 16;
+};
+
+inline i16 loadU8AsI16(const uint8_t* src) { return { _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src))) }; }
+inline i16 add(i16 a, i16 b) { return { _mm256_add_epi16(a.v, b.v) }; }
+inline i16 sub(i16 a, i16 b) { return { _mm256_sub_epi16(a.v, b.v) }; }
+inline i16 max(i16 a, i16 b) { return { _mm256_max_epi16(a.v, b.v) }; }
+inline i16 abs(i16 a) { return { _mm256_abs_epi16(a.v) }; }
+inline i16 loadI16(const int16_t* src) { return { _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)) }; }
+inline i16 set1I16(int16_t x) { return { _mm256_set1_epi16(x) }; }
+inline i16 mulLow(i16 a, i16 b) { return { _mm256_mullo_epi16(a.v, b.v) }; }
+inline i16 shiftRightUnsigned(i16 a, int bits) { return { _mm256_srli_epi16(a.v, bits) }; }
+
+inline void storeU8(uint8_t* dst, i16 a) {
+	__m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(a.v), _mm256_extracti128_si256(a.v, 1));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), bytes);
+}
+
+#elif defined(CELLBASE_SIMD_SSE2)
+
+struct f32 {
+	__m128 v;
+	static constexpr int lanes = 4;
+};
+
+inline f32 zero() { return { _mm_setzero_ps() }; }
+inline f32 set1(float x) { return { _mm_set1_ps(x) }; }
+inline f32 load(const float* src) { return { _mm_loadu_ps(src) }; }
+inline void store(float* dst, f32 a) { _mm_storeu_ps(dst, a.v); }
+inline f32 add(f32 a, f32 b) { return { _mm_add_ps(a.v, b.v) }; }
+inline f32 sub(f32 a, f32 b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline f32 mul(f32 a, f32 b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline f32 min(f32 a, f32 b) { return { _mm_min_ps(a.v, b.v) }; }
+inline f32 max(f32 a, f32 b) { return { _mm_max_ps(a.v, b.v) }; }
+
+inline f32 loadI32(const int32_t* src) { return { _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src))) }; }
+
+inline f32 loadU8(const uint8_t* src) {
+	int32_t bytes;
+	std::memcpy(&bytes, src, sizeof(bytes));
+	__m128i zero = _mm_setzero_si128();
+	__m128i i16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+	return { _mm_cvtepi32_ps(_mm_unpacklo_epi16(i16, zero)) };
+}
+
+inline void storeU8(uint8_t* dst, f32 a) {
+	__m128i i32 = _mm_cvtps_epi32(a.v);
+	__m128i i16 = _mm_packs_epi32(i32, i32);
+	int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(i16, i16));
+	std::memcpy(dst, &bytes, sizeof(bytes));
+}
+
+inline f32 loadU16(const uint16_t* src) {
+	__m128i u16 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src));
+	return { _mm_cvtepi32_ps(_mm_unpacklo_epi16(u16, _mm_setzero_si128())) };
+}
+
+// SSE2 has no unsigned 32 -> 16 bit pack, so values are clamped first and packed with a bias.
+inline void storeU16(uint16_t* dst, f32 a) {
+	__m128 clamped = _mm_min_ps(_mm_max_ps(a.v, _mm_setzero_ps()), _mm_set1_ps(65535.0f));
+	__m128i biased = _mm_sub_epi32(_mm_cvtps_epi32(clamped), _mm_set1_epi32(32768));
+	__m128i u16 = _mm_xor_si128(_mm_packs_epi32(biased, biased), _mm_set1_epi16(static_cast<short>(0x8000)));
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(dst), u16);
+}
+
+struct i16 {
+	__m128i v;
+	static constexpr int lanes = 8;
+};
+
+inline i16 loadU8AsI16(const uint8_t* src) { return { _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src)), _mm_setzero_si128()) }; }
+inline i16 add(i16 a, i16 b) { return { _mm_add_epi16(a.v, b.v) }; }
+inline i16 sub(i16 a, i16 b) { return { _mm_sub_epi16(a.v, b.v) }; }
+inline i16 max(i16 a, i16 b) { return { _mm_max_epi16(a.v, b.v) }; }
+inline i16 abs(i16 a) { return { _mm_max_epi16(a.v, _mm_sub_epi16(_mm_setzero_si128(), a.v)) }; }
+inline i16 loadI16(const int16_t* src) { return { _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)) }; }
+inline i16 set1I16(int16_t x) { return { _mm_set1_epi16(x) }; }
+inline i16 mulLow(i16 a, i16 b) { return { _mm_mullo_epi16(a.v, b.v) }; }
+inline i16 shiftRightUnsigned(i16 a, int bits) { return { _mm_srli_epi16(a.v, bits) }; }
+
+inline void storeU8(uint8_t* dst, i16 a) {
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packus_epi16(a.v, a.v));
+}
+
+#else
+
+struct f32 {
+	float v;
+	static constexpr int lanes = 1;
+};
+
+inline f32 zero() { return { 0.0f }; }
+inline f32 set1(float x) { return { x }; }
+inline f32 load(const float* src) { return { *src }; }
+inline void store(float* dst, f32 a) { *dst = a.v; }
+inline f32 add(f32 a, f32 b) { return { a.v + b.v }; }
+inline f32 sub(f32 a, f32 b) { return { a.v - b.v }; }
+inline f32 mul(f32 a, f32 b) { return { a.v * b.v }; }
+inline f32 min(f32 a, f32 b) { return { a.v < b.v ? a.v : b.v }; }
+inline f32 max(f32 a, f32 b) { return { a.v > b.v ? a.v : b.v }; }
+inline f32 loadI32(const int32_t* src) { return { static_cast<float>(*src) }; }
+inline f32 loadU8(const uint8_t* src) { return { static_cast<float>(*src) }; }
+
+inline void storeU8(uint8_t* dst, f32 a) {
+	long rounded = std::lrint(a.v);
+	*dst = static_cast<uint8_t>(rounded < 0 ? 0 : rounded > 255 ? 255 : rounded);
+}
+
+inline f32 loadU16(const uint16_t* src) { return { static_cast<float>(*src) }; }
+
+inline void storeU16(uint16_t* dst, f32 a) {
+	long rounded = std::lrint(a.v);
+	*dst = static_cast<uint16_t>(rounded < 0 ? 0 : rounded > 65535 ? 65535 : rounded);
+}
+
+
+struct i16 {
+	int16_t v;
+	static constexpr int lanes = 1;
+};
+
+inline i16 loadU8AsI16(const uint8_t* src) { return { static_cast<int16_t>(*src) }; }
+inline i16 add(i16 a, i16 b) { return { static_cast<int16_t>(a.v + b.v) }; }
+inline i16 sub(i16 a, i16 b) { return { static_cast<int16_t>(a.v - b.v) }; }
+inline i16 max(i16 a, i16 b) { return { a.v > b.v ? a.v : b.v }; }
+inline i16 abs(i16 a) { return { static_cast<int16_t>(a.v < 0 ? -a.v : a.v) }; }
+inline i16 loadI16(const int16_t* src) { return { *src }; }
+inline i16 set1I16(int16_t x) { return { x }; }
+inline i16 mulLow(i16 a, i16 b) { return { static_cast<int16_t>(static_cast<uint32_t>(static_cast<uint16_t>(a.v)) * static_cast<uint16_t>(b.v)) }; }
+inline i16 shiftRightUnsigned(i16 a, int bits) { return { static_cast<int16_t>(static_cast<uint16_t>(a.v) >> bits) }; }
+
+inline void storeU8(uint8_t* dst, i16 a) {
+	*dst = static_cast<uint8_t>(a.v < 0 ? 0 : a.v > 255 ? 255 : a.v);
+}
+
+#endif
+
+#if defined(CELLBASE_SIMD_AVX2) || defined(CELLBASE_SIMD_SSE2)
+
+struct u8x16 {
+	__m128i v;
+};
+
+inline u8x16 loadU8x16(const uint8_t* src) { return { _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)) }; }
+
+// Bit i is set where |a[i] - b[i]| <= tolerance[i].
+inline int matchU8x16(u8x16 a, u8x16 b, u8x16 tolerance) {
+	__m128i diff = _mm_or_si128(_mm_subs_epu8(a.v, b.v), _mm_subs_epu8(b.v, a.v));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(diff, tolerance.v), _mm_setzero_si128()));
+}
+
+#else
+
+struct u8x16 {
+	uint8_t v[16];
+};
+
+inline u8x16 loadU8x16(const uint8_t* src) {
+	u8x16 a;
+	std::memcpy(a.v, src, sizeof(a.v));
+	return a;
+}
+
+inline int matchU8x16(u8x16 a, u8x16 b, u8x16 tolerance) {
+	int bits = 0;
+	for (int i = 0; i < 16; i++) {
+		const int diff = a.v[i] > b.v[i] ? a.v[i] - b.v[i] : b.v[i] - a.v[i];
+		bits |= (diff <= tolerance.v[i]) << i;
+	}
+	return bits;
+}
+
+#endif
+
+// Groups of groupBits bits, step * groupBits bits apart, covering 16 source bits.
+constexpr uint64_t spreadMask(int step, int groupBits) {
+	uint64_t mask = 0;
+	for (int group = 0; group * groupBits < 16; group++) {
+		mask |= ((uint64_t(1) << groupBits) - 1) << (group * step * groupBits);
+	}
+	return mask;
+}
+
+// Bits 0, step, 2 * step, ... 15 * step of bits, packed into bits 0 to 15. With BMI2 this is one
+// pext; otherwise neighbouring groups are merged pairwise in four shift-and-mask rounds.
+template<int step>
+inline int gatherBits(uint64_t bits) {
+#if defined(__BMI2__)
+	return static_cast<int>(_pext_u64(bits, spreadMask(step, 1)));
+#else
+	bits &= spreadMask(step, 1);
+	bits = (bits | (bits >> (1 * (step - 1)))) & spreadMask(step, 2);
+	bits = (bits | (bits >> (2 * (step - 1)))) & spreadMask(step, 4);
+	bits = (bits | (bits >> (4 * (step - 1)))) & spreadMask(step, 8);
+	bits = (bits | (bits >> (8 * (step - 1)))) & spreadMask(step, 16);
+	return static_cast<int>(bits);
+#endif
+}
+
+}
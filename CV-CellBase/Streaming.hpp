@@ -0,0 +1,227 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Fixed-capacity FIFO between two threads. push blocks while the queue is full, so a fast
+// producer waits for a slow consumer instead of piling up frames.
+template<typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t _capacity) : capacity(std::max<size_t>(1, _capacity)) {}
+
+	// Returns false if the queue was closed; the item is dropped.
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+		if (closed) {
+			return false;
+		}
+
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// Returns false once the queue is closed and drained.
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+		if (items.empty()) {
+			return false;
+		}
+
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// Wakes every waiting thread. Items already queued can still be popped.
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	size_t capacity;
+	std::deque<T> items;
+	bool closed = false;
+	std::mutex mutex;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+};
+
+struct Frame {
+	size_t index;
+	cv::Mat img;
+};
+
+// Collects frames finished out of order and hands them back in index order. It also caps the frames
+// in flight: reserve(index) blocks until index is within capacity of the first frame not yet
+// released, so a frame counts until its consumer is done with it.
+class ReorderBuffer {
+public:
+	ReorderBuffer(size_t _capacity) : capacity(std::max<size_t>(1, _capacity)) {}
+
+	// Returns false if the buffer was closed.
+	bool reserve(size_t index) {
+		std::unique_lock<std::mutex> lock(mutex);
+		windowOpen.wait(lock, [&] { return closed || index < releasedCount + capacity; });
+		return !closed;
+	}
+
+	void put(Frame frame) {
+		std::lock_guard<std::mutex> lock(mutex);
+		frames.emplace(frame.index, std::move(frame.img));
+		frameReady.notify_all();
+	}
+
+	// Waits for the next frame in order. Returns false if the buffer was closed first.
+	bool take(Frame& frame) {
+		std::unique_lock<std::mutex> lock(mutex);
+		frameReady.wait(lock, [&] { return closed || frames.count(nextIndex) != 0; });
+		if (closed) {
+			return false;
+		}
+
+		auto found = frames.find(nextIndex);
+		frame = Frame{ nextIndex, std::move(found->second) };
+		frames.erase(found);
+		nextIndex++;
+		return true;
+	}
+
+	// Called once the frame last taken is no longer needed.
+	void release() {
+		std::lock_guard<std::mutex> lock(mutex);
+		releasedCount++;
+		windowOpen.notify_all();
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		windowOpen.notify_all();
+		frameReady.notify_all();
+	}
+
+private:
+	size_t capacity;
+	size_t nextIndex = 0;
+	size_t releasedCount = 0;
+	std::map<size_t, cv::Mat> frames;
+	bool closed = false;
+	std::mutex mutex;
+	std::condition_variable windowOpen;
+	std::condition_variable frameReady;
+};
+
+// Runs read -> process -> write as overlapping stages joined by bounded queues, so memory stays
+// bounded whatever the sequence length. workerCount threads each process whole frames, with a
+// processor of their own from makeProcessor() so filter instances are never shared between threads.
+// Workers take chunkSize consecutive frames at a time and process them in order, so a processor
+// that keeps state from one frame to the next (IncrementalProcessor) sees neighbouring frames.
+// Frames are written in index order, and at most maxFramesInFlight frames exist between read and
+// write. The cap is never raised: chunkSize is lowered instead, down to 1, so that every worker can
+// hold a chunk within it (below workerCount frames some workers wait). read runs
+// on its own thread and write on the calling thread, which keeps HighGUI calls made from it on the
+// thread that owns the windows. The first exception thrown by any stage stops the others and is
+// rethrown here.
+template<typename Read, typename MakeProcessor, typename Write>
+void streamFramesParallel(size_t frameCount, Read&& read, MakeProcessor&& makeProcessor, Write&& write, size_t workerCount, size_t maxFramesInFlight, size_t chunkSize = 1) {
+	workerCount = std::max<size_t>(1, workerCount);
+	maxFramesInFlight = std::max<size_t>(1, maxFramesInFlight);
+	chunkSize = std::clamp<size_t>(maxFramesInFlight / workerCount, 1, std::max<size_t>(1, chunkSize));
+
+	BoundedQueue<std::vector<Frame>> readQueue(maxFramesInFlight / chunkSize);
+	ReorderBuffer reorderBuffer(maxFramesInFlight);
+
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	auto fail = [&] {
+		{
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!error) {
+				error = std::current_exception();
+			}
+		}
+		readQueue.close();
+		reorderBuffer.close();
+	};
+
+	std::thread reader([&] {
+		try {
+			for (size_t chunkStart = 0; chunkStart < frameCount; chunkStart += chunkSize) {
+				std::vector<Frame> chunk;
+				for (size_t index = chunkStart; index < std::min(chunkStart + chunkSize, frameCount); index++) {
+					if (!reorderBuffer.reserve(index)) {
+						break;
+					}
+					chunk.push_back(Frame{ index, read(index) });
+				}
+
+				if (chunk.size() < std::min(chunkSize, frameCount - chunkStart) || !readQueue.push(std::move(chunk))) {
+					break;
+				}
+			}
+		}
+		catch (...) {
+			fail();
+		}
+		readQueue.close();
+	});
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < workerCount; i++) {
+		workers.emplace_back([&] {
+			try {
+				auto process = makeProcessor();
+
+				std::vector<Frame> chunk;
+				while (readQueue.pop(chunk)) {
+					for (auto& frame : chunk) {
+						frame.img = process(frame);
+						reorderBuffer.put(std::move(frame));
+					}
+				}
+			}
+			catch (...) {
+				fail();
+			}
+		});
+	}
+
+	try {
+		Frame frame;
+		for (size_t index = 0; index < frameCount && reorderBuffer.take(frame); index++) {
+			write(frame);
+			frame.img.release();
+			reorderBuffer.release();
+		}
+	}
+	catch (...) {
+		fail();
+	}
+	readQueue.close();
+	reorderBuffer.close();
+
+	reader.join();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
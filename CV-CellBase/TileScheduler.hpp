@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "BufferPool.hpp"
+#include "Trace.hpp"
+
+struct Tile {
+	cv::Rect rect;
+	cv::Rect haloRect;
+	cv::Size halo;
+
+	// Source pixels for rect plus its halo. Outside the image the edge pixels are replicated, so a
+	// filter reading the padded tile sees exactly what a clamped read of the whole image would see.
+	cv::Mat pad(const cv::Mat& img) const {
+		const int top = haloRect.y - (rect.y - halo.height);
+		const int bottom = (rect.y + rect.height + halo.height) - (haloRect.y + haloRect.height);
+		const int left = haloRect.x - (rect.x - halo.width);
+		const int right = (rect.x + rect.width + halo.width) - (haloRect.x + haloRect.width);
+
+		cv::Mat paddedImg = BufferPool::shared().acquire(cv::Size(rect.width + 2 * halo.width, rect.height + 2 * halo.height), img.type());
+		cv::copyMakeBorder(img(haloRect), paddedImg, top, bottom, left, right, cv::BORDER_REPLICATE | cv::BORDER_ISOLATED);
+		return paddedImg;
+	}
+};
+
+// Splits an image into tiles and runs them on OpenCV's thread pool. Every output pixel belongs to
+// exactly one tile and is computed the same way whatever the tiling, so results do not depend on
+// the tile size or the thread count.
+class TileScheduler {
+public:
+	cv::Size tileSize;
+
+	TileScheduler(cv::Size _tileSize = cv::Size(512, 64)) : tileSize(_tileSize) {}
+
+	static TileScheduler rowBands(int bandHeight = 64) {
+		return TileScheduler(cv::Size(INT_MAX, bandHeight));
+	}
+
+	static TileScheduler columnBands(int bandWidth = 64) {
+		return TileScheduler(cv::Size(bandWidth, INT_MAX));
+	}
+
+	// threadCount <= 0 restores OpenCV's default of one thread per core.
+	static void setThreadCount(int threadCount) {
+		cv::setNumThreads(threadCount > 0 ? threadCount : -1);
+	}
+
+	static int threadCount() {
+		return cv::getNumThreads();
+	}
+
+	std::vector<Tile> split(cv::Size imgSize, cv::Size halo = cv::Size(0, 0)) const {
+		const int tileWidth = std::max(1, std::min(tileSize.width, imgSize.width));
+		const int tileHeight = std::max(1, std::min(tileSize.height, imgSize.height));
+		const cv::Rect imgRect(0, 0, imgSize.width, imgSize.height);
+
+		std::vector<Tile> tiles;
+		for (int tileY = 0; tileY < imgSize.height; tileY += tileHeight) {
+			for (int tileX = 0; tileX < imgSize.width; tileX += tileWidth) {
+				Tile tile;
+				tile.rect = cv::Rect(tileX, tileY, std::min(tileWidth, imgSize.width - tileX), std::min(tileHeight, imgSize.height - tileY));
+				tile.haloRect = cv::Rect(tile.rect.x - halo.width, tile.rect.y - halo.height, tile.rect.width + 2 * halo.width, tile.rect.height + 2 * halo.height) & imgRect;
+				tile.halo = halo;
+				tiles.push_back(tile);
+			}
+		}
+
+		return tiles;
+	}
+
+	template<typename Body>
+	void run(cv::Size imgSize, cv::Size halo, Body&& body) const {
+		const auto tiles = split(imgSize, halo);
+
+		parallelFor(static_cast<int>(tiles.size()), [&](int i) {
+			body(tiles[i]);
+		});
+	}
+
+	// Maps every tile to a partial result, then folds the partials in tile order so the result is
+	// deterministic even for order-sensitive combines.
+	template<typename T, typename Map, typename Combine>
+	T reduce(cv::Size imgSize, cv::Size halo, T init, Map&& map, Combine&& combine) const {
+		const auto tiles = split(imgSize, halo);
+		std::vector<T> partials(tiles.size());
+
+		parallelFor(static_cast<int>(tiles.size()), [&](int i) {
+			partials[i] = map(tiles[i]);
+		});
+
+		T result = init;
+		for (auto& partial : partials) {
+			result = combine(std::move(result), std::move(partial));
+		}
+
+		return result;
+	}
+
+	// Runs body over [0, count) in chunks of grainSize, for work that is not laid out as an image.
+	template<typename Body>
+	void runRange(int count, int grainSize, Body&& body) const {
+		const int chunkCount = (count + grainSize - 1) / grainSize;
+
+		parallelFor(chunkCount, [&](int i) {
+			body(cv::Range(i * grainSize, std::min(count, (i + 1) * grainSize)));
+		});
+	}
+
+private:
+	// cv::parallel_for_ over [0, count). While tracing, also adds up how long the caller waited and
+	// how long the workers were busy, which gives the thread utilization of the enclosing stage.
+	template<typename Body>
+	static void parallelFor(int count, Body&& body) {
+		auto loop = [&](const cv::Range& range) {
+			for (int i = range.start; i < range.end; i++) {
+				body(i);
+			}
+		};
+
+		if (!trace::isEnabled()) {
+			cv::parallel_for_(cv::Range(0, count), loop);
+			return;
+		}
+
+		const int64_t startNs = trace::now();
+		cv::parallel_for_(cv::Range(0, count), [&](const cv::Range& range) {
+			const int64_t rangeStartNs = trace::now();
+			loop(range);
+			trace::counters.parallelBusyNs += trace::now() - rangeStartNs;
+		});
+		trace::counters.parallelWallNs += trace::now() - startNs;
+	}
+};
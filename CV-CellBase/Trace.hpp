@@ -0,0 +1,294 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#if defined(__GNUC__)
+#include <cxxabi.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+// Set to 0 to compile tracing out. Otherwise it is switched on at runtime with trace::setEnabled, and
+// while off costs one relaxed atomic load per stage and per parallel loop.
+#ifndef CELLBASE_TRACE
+#define CELLBASE_TRACE 1
+#endif
+
+// Records one event per filter stage, composite and frame: wall time, cv::Mat bytes allocated,
+// output pixels and how busy the worker threads were. Allocations and thread time are counted
+// process-wide, so events that overlap in time (frames processed in parallel) share them.
+namespace trace {
+
+struct Event {
+	std::string category; // "filter", "composite" or "frame"
+	std::string name;
+	int64_t frameIndex = -1;
+	int64_t startNs = 0;
+	int64_t durationNs = 0;
+	int threadIndex = 0;
+	int64_t allocatedBytes = 0;
+	size_t pixels = 0;
+	double threadUtilization = 0.0; // busy thread time / (duration * thread count)
+};
+
+inline int64_t now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Counters {
+	std::atomic<int64_t> allocatedBytes{ 0 };
+	std::atomic<int64_t> parallelWallNs{ 0 }; // time callers spent waiting in parallel loops
+	std::atomic<int64_t> parallelBusyNs{ 0 }; // time worker threads spent running them
+};
+
+inline Counters counters;
+
+inline std::atomic<bool> enabled{ false };
+
+inline bool isEnabled() {
+#if CELLBASE_TRACE
+	return enabled.load(std::memory_order_relaxed);
+#else
+	return false;
+#endif
+}
+
+// Small stable index of the calling thread, for the trace viewer's rows.
+inline int threadIndex() {
+	static std::atomic<int> nextIndex{ 0 };
+	thread_local const int index = nextIndex++;
+	return index;
+}
+
+// Class name without the compiler's mangling or "class " prefix.
+inline std::string typeName(const std::type_info& type) {
+#if defined(__GNUC__)
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+	if (status == 0 && demangled != nullptr) {
+		std::string name = demangled;
+		std::free(demangled);
+		return name;
+	}
+	return type.name();
+#else
+	std::string name = type.name();
+	for (const std::string prefix : { "class ", "struct " }) {
+		if (name.rfind(prefix, 0) == 0) {
+			return name.substr(prefix.size());
+		}
+	}
+	return name;
+#endif
+}
+
+// Counts the bytes of cv::Mat buffers while tracing; OpenCV's own allocator does the work.
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+		cv::UMatData* u = cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+		if (u != nullptr && data == nullptr) {
+			counters.allocatedBytes += static_cast<int64_t>(u->size);
+		}
+		return u;
+	}
+
+	bool allocate(cv::UMatData* data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override {
+		return cv::Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+	}
+
+	void deallocate(cv::UMatData* data) const override {
+		cv::Mat::getStdAllocator()->deallocate(data);
+	}
+};
+
+class Recorder {
+public:
+	void record(Event event) {
+		std::lock_guard<std::mutex> lock(mutex);
+		events.push_back(std::move(event));
+	}
+
+	std::vector<Event> snapshot() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return events;
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(mutex);
+		events.clear();
+	}
+
+private:
+	mutable std::mutex mutex;
+	std::vector<Event> events;
+};
+
+inline Recorder recorder;
+
+inline void setEnabled(bool isOn) {
+#if CELLBASE_TRACE
+	static CountingMatAllocator matAllocator;
+	cv::Mat::setDefaultAllocator(isOn ? &matAllocator : nullptr);
+	enabled = isOn;
+#endif
+}
+
+// Times the enclosing block as one event. The name is only built when tracing is on.
+class Scope {
+public:
+	template<typename NameFn>
+	Scope(const char* category, NameFn&& nameFn, int64_t frameIndex = -1) {
+		if (!isEnabled()) {
+			return;
+		}
+
+		isActive = true;
+		event.category = category;
+		event.name = nameFn();
+		event.frameIndex = frameIndex;
+		event.threadIndex = threadIndex();
+		startAllocatedBytes = counters.allocatedBytes;
+		startParallelWallNs = counters.parallelWallNs;
+		startParallelBusyNs = counters.parallelBusyNs;
+		event.startNs = now();
+	}
+
+	Scope(const Scope&) = delete;
+	Scope& operator=(const Scope&) = delete;
+
+	void setPixels(size_t pixels) {
+		event.pixels = pixels;
+	}
+
+	~Scope() {
+		if (!isActive) {
+			return;
+		}
+
+		event.durationNs = now() - event.startNs;
+		event.allocatedBytes = counters.allocatedBytes - startAllocatedBytes;
+
+		// Outside parallel loops the calling thread is the only busy one.
+		const int64_t parallelWallNs = counters.parallelWallNs - startParallelWallNs;
+		const int64_t parallelBusyNs = counters.parallelBusyNs - startParallelBusyNs;
+		const double busyNs = static_cast<double>(std::max<int64_t>(0, event.durationNs - parallelWallNs) + parallelBusyNs);
+		if (event.durationNs > 0) {
+			event.threadUtilization = std::min(1.0, busyNs / (static_cast<double>(event.durationNs) * std::max(1, cv::getNumThreads())));
+		}
+
+		recorder.record(std::move(event));
+	}
+
+private:
+	bool isActive = false;
+	Event event;
+	int64_t startAllocatedBytes = 0;
+	int64_t startParallelWallNs = 0;
+	int64_t startParallelBusyNs = 0;
+};
+
+// One row per category and name, in order of first appearance.
+inline void writeSummary(std::ostream& stream) {
+	struct Row {
+		std::string category;
+		std::string name;
+		size_t calls = 0;
+		int64_t totalNs = 0;
+		int64_t maxNs = 0;
+		int64_t allocatedBytes = 0;
+		double pixels = 0.0;
+		double busyNs = 0.0;
+	};
+
+	std::vector<Row> rows;
+	std::map<std::pair<std::string, std::string>, size_t> rowIndices;
+	for (const auto& event : recorder.snapshot()) {
+		const auto found = rowIndices.try_emplace({ event.category, event.name }, rows.size());
+		if (found.second) {
+			rows.push_back(Row{ event.category, event.name });
+		}
+
+		auto& row = rows[found.first->second];
+		row.calls++;
+		row.totalNs += event.durationNs;
+		row.maxNs = std::max(row.maxNs, event.durationNs);
+		row.allocatedBytes += event.allocatedBytes;
+		row.pixels += static_cast<double>(event.pixels);
+		row.busyNs += event.threadUtilization * event.durationNs;
+	}
+
+	const auto flags = stream.flags();
+	const auto precision = stream.precision();
+	stream << std::left << std::setw(10) << "category" << std::setw(40) << "name" << std::right
+		<< std::setw(7) << "calls" << std::setw(12) << "total ms" << std::setw(10) << "mean ms" << std::setw(10) << "max ms"
+		<< std::setw(10) << "MP/s" << std::setw(12) << "MB alloc" << std::setw(8) << "util" << "\n";
+	for (const auto& row : rows) {
+		const double totalMs = row.totalNs * 1e-6;
+		stream << std::left << std::setw(10) << row.category << std::setw(40) << row.name.substr(0, 39) << std::right << std::fixed
+			<< std::setw(7) << row.calls
+			<< std::setw(12) << std::setprecision(2) << totalMs
+			<< std::setw(10) << std::setprecision(2) << totalMs / row.calls
+			<< std::setw(10) << std::setprecision(2) << row.maxNs * 1e-6
+			<< std::setw(10) << std::setprecision(1) << (row.totalNs > 0 ? row.pixels / row.totalNs * 1e3 : 0.0)
+			<< std::setw(12) << std::setprecision(1) << row.allocatedBytes / 1048576.0
+			<< std::setw(7) << std::setprecision(0) << (row.totalNs > 0 ? 100.0 * row.busyNs / row.totalNs : 0.0) << "%\n";
+	}
+	stream.flags(flags);
+	stream.precision(precision);
+}
+
+// Chrome trace event format, readable by chrome://tracing and ui.perfetto.dev.
+inline bool writeChromeTrace(const std::string& path) {
+	auto escape = [](const std::string& text) {
+		std::string escaped;
+		for (const char c : text) {
+			if (c == '"' || c == '\\') {
+				escaped += '\\';
+			}
+			escaped += c;
+		}
+		return escaped;
+	};
+
+	std::ofstream stream(path);
+	if (!stream) {
+		return false;
+	}
+
+	const auto events = recorder.snapshot();
+	int64_t originNs = INT64_MAX;
+	for (const auto& event : events) {
+		originNs = std::min(originNs, event.startNs);
+	}
+
+	stream << std::fixed << std::setprecision(3);
+	stream << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	for (size_t i = 0; i < events.size(); i++) {
+		const auto& event = events[i];
+		stream << "{\"name\": \"" << escape(event.name) << "\", \"cat\": \"" << event.category << "\", \"ph\": \"X\""
+			<< ", \"ts\": " << (event.startNs - originNs) * 1e-3 << ", \"dur\": " << event.durationNs * 1e-3
+			<< ", \"pid\": 1, \"tid\": " << event.threadIndex
+			<< ", \"args\": {\"pixels\": " << event.pixels << ", \"allocatedBytes\": " << event.allocatedBytes
+			<< ", \"threadUtilization\": " << event.threadUtilization;
+		if (event.frameIndex >= 0) {
+			stream << ", \"frameIndex\": " << event.frameIndex;
+		}
+		stream << "}}" << (i + 1 < events.size() ? "," : "") << "\n";
+	}
+	stream << "]}\n";
+
+	return static_cast<bool>(stream);
+}
+}
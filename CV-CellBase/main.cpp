@@ -1,14 +1,21 @@
 #include "Filter.hpp"
 #include "CellBlur.hpp"
 #include "LineRemover.hpp"
+#include "FilterGraph.hpp"
+#include "Streaming.hpp"
+#include "Incremental.hpp"
+#include "ChalkFilter.hpp"
 
+// Visual Studio links OpenCV from here; other builds link it through CMake.
+#if defined(_MSC_VER)
 #ifdef _DEBUG
 #pragma comment (lib, "opencv_world4100d.lib")
 #else
 #pragma comment (lib, "opencv_world4100.lib")
 #endif
+#endif
 
-cv::Mat characterCellProcessing(cv::Mat srcImg) {
+FilterGraph characterCellGraph() {
 	std::vector clothesColors = {
 		cv::Vec3b(111, 105, 161),
 		cv::Vec3b(144, 160, 130),
@@ -33,81 +40,103 @@ cv::Mat characterCellProcessing(cv::Mat srcImg) {
 
 	std::vector targetColorsList = { clothesColors, hairColors1, hairColors2, eyeColors };
 
-	cv::Mat layer_1 = applyFilters(
-		srcImg, {
+	std::vector<cv::Vec4b> lineColors = { {4,2,10,0} };
+	std::vector<cv::Vec4b> excludingColors = { {255,255,255,0} };
+
+	// layer_2 starts with the same CellBlur as layer_1, so the graph computes it once.
+	FilterGraph graph;
+	auto layer_1 = graph.add(
+		FilterGraph::source, {
 			std::make_shared<::CellBlur>(20.0f, 21, targetColorsList),
 		});
 
-	std::vector<cv::Vec4b> lineColors = { {4,2,10,0} };
-	std::vector<cv::Vec4b> excludingColors = { {255,255,255,0} };
-	cv::Mat layer_2 = applyFilters(
-		srcImg, {
+	auto layer_2 = graph.add(
+		FilterGraph::source, {
 			std::make_shared<::CellBlur>(20.0f, 21, targetColorsList),
 			std::make_shared<LineRemover3b>(lineColors, excludingColors, 100),
 		});
 
-	cv::Mat layer_3 = applyFilters(
-		srcImg, {
+	auto layer_3 = graph.add(
+		FilterGraph::source, {
 			std::make_shared<LineOnly>(),
 		});
 
-	cv::Mat layer_1_2 = applyLayersWithAlpha(layer_1, layer_2, 0.7);
-	cv::Mat layer_1_2_3 = applyLayersWithAlpha(layer_1_2, layer_3, 0.3);
+	auto layer_1_2_3 = graph.compositeLayers({ layer_1, layer_2, layer_3 }, { 0.7, 0.3 });
+	graph.setOutput("characterCell", layer_1_2_3);
+
+	return graph;
+}
 
-	return layer_1_2_3;
+cv::Mat characterCellProcessing(cv::Mat srcImg) {
+	return characterCellGraph().run(srcImg).at("characterCell");
 }
 
-void characterCellProcessingMovie(const std::string& srcImgsPathPattern, const std::string& dstMoviePath) {
+// With a tracePath, every frame and every filter stage is timed; a summary is printed at the end and
+// a Chrome trace (chrome://tracing, ui.perfetto.dev) is written to tracePath.
+void characterCellProcessingMovie(const std::string& srcImgsPathPattern, const std::string& dstMoviePath, const std::string& tracePath = "") {
 	std::vector<cv::String> srcImgPaths;
-	std::vector<cv::Mat> dstImgs;
 	cv::glob(srcImgsPathPattern, srcImgPaths, true);
 
-	for (const std::string& srcImgPath : srcImgPaths) {
-		cv::Mat srcImg = cv::imread(srcImgPath);
-		if (srcImg.empty()) {
-			throw "No image found! " + srcImgPath;
-		}
-
-		cv::Mat dstImg = characterCellProcessing(srcImg);
-		dstImgs.push_back(dstImg);
-		imshow("CharacterCellProcessingMovie", dstImg);
-		cv::waitKey(1);
-	}
+	cv::VideoWriter writer;
 
-	int fourcc = cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
-	cv::VideoWriter writer(dstMoviePath, fourcc, 12, dstImgs[0].size(), true);
-	if (!writer.isOpened()) {
-		throw "writer not opened: " + dstMoviePath;
+	if (!tracePath.empty()) {
+		trace::recorder.clear();
+		trace::setEnabled(true);
 	}
 
-	for (const cv::Mat& dstImg : dstImgs) {
-		writer.write(dstImg);
-	}
+	// Frames are independent, so several are processed at once, each worker with its own graph.
+	// Workers take runs of chunkSize consecutive frames, so within a run each frame is compared
+	// with the one just before it. Output goes to the writer in glob order, and the in-flight cap
+	// keeps memory bounded.
+	const size_t workerCount = std::max(1u, std::thread::hardware_concurrency());
+	const size_t chunkSize = 4;
+	streamFramesParallel(
+		srcImgPaths.size(),
+		[&](size_t index) {
+			cv::Mat srcImg = cv::imread(srcImgPaths[index]);
+			if (srcImg.empty()) {
+				throw "No image found! " + srcImgPaths[index];
+			}
+			return srcImg;
+		},
+		[heldFrames = std::make_shared<HeldFrameCache>(2 * workerCount)] {
+			// Held frames are reused, and partly changed ones only recompute what differs from the previous frame of the run.
+			return [processor = IncrementalProcessor(characterCellGraph(), "characterCell", heldFrames)](const Frame& frame) mutable {
+				trace::Scope scope("frame", [] { return std::string("characterCell"); }, static_cast<int64_t>(frame.index));
+				cv::Mat dstImg = processor.process(frame.img, frame.index);
+				scope.setPixels(dstImg.total());
+				return dstImg;
+			};
+		},
+		[&](const Frame& frame) {
+			imshow("CharacterCellProcessingMovie", frame.img);
+			cv::waitKey(1);
+
+			if (!writer.isOpened()) {
+				int fourcc = cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
+				writer.open(dstMoviePath, fourcc, 12, frame.img.size(), true);
+				if (!writer.isOpened()) {
+					throw "writer not opened: " + dstMoviePath;
+				}
+			}
+
+			writer.write(frame.img);
+		},
+		workerCount, (workerCount + 1) * chunkSize, chunkSize);
 
 	writer.release();
+
+	if (!tracePath.empty()) {
+		trace::setEnabled(false);
+		trace::writeSummary(std::cout);
+		if (!trace::writeChromeTrace(tracePath)) {
+			throw "trace not written: " + tracePath;
+		}
+	}
 }
 
 cv::Mat chalkFilter(cv::Mat srcImage) {
-	auto colorLine = applyFilters(
-		srcImage, {
-			std::make_shared<::SobelAbsXY>(),
-			std::make_shared<::GaussianBlur>(2.0f, 3),
-		});
-
-	cv::Mat grayLine;
-	cvtColor(colorLine, grayLine, cv::COLOR_BGR2GRAY);
-	cv::Mat mask = grayLine != 0;
-
-	cv::Mat noise(colorLine.size(), colorLine.type());
-	cv::randn(noise, 300, 200);
-
-	cv::Mat_<cv::Vec3i> iNoisedColorLine = static_cast<cv::Mat_<cv::Vec3i>>(colorLine) + static_cast<cv::Mat_<cv::Vec3i>>(noise);
-	cv::Mat_<cv::Vec3b> bNoisedColorLine = iNoisedColorLine & cv::Vec3i(255, 255, 255);
-
-	cv::Mat noisedGrayLine;
-	cvtColor(bNoisedColorLine, noisedGrayLine, cv::COLOR_BGR2GRAY);
-
-	return noisedGrayLine & mask;
+	return ChalkFilter().apply(srcImage);
 }
 
 void chokedLine(cv::Mat srcImage) {
@@ -153,6 +182,7 @@ int main()
 
 	// cv::imshow("CharacterCellProcessing", characterCellProcessing(srcImage));
 	// characterCellProcessingMovie("movie_test/*.png", "results.avi");
+	// characterCellProcessingMovie("movie_test/*.png", "results.avi", "results_trace.json");
 
 	// auto chalkImage = chalkFilter(srcImage);
 	// cv::imshow("ChalkFilter", chalkImage);
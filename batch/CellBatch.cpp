@@ -0,0 +1,144 @@
+// Runs a pipeline config over a set of images, headless.
+//
+//   cellbase-batch <config> <input glob> <output dir> [--workers n] [--chunk n] [--first-index n] [--threads n] [--ext .png] [--trace path]
+//
+// Frames are processed several at a time, each worker with its own graph, and written in glob order
+// as <output dir>/<input name><ext>. Workers take runs of --chunk consecutive frames (4 by default),
+// and within a run identical or partly changed frames reuse the previous result, as in
+// characterCellProcessingMovie. Filters keyed by frame index (ChalkFilter's noise) see the glob
+// position plus --first-index (0 by default), so a sequence rendered in parts matches a whole render.
+// Images are read at their own depth and channel count (16-bit and BGRA plates stay as they are);
+// only grayscale ones are expanded to BGR.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "Incremental.hpp"
+#include "PipelineConfig.hpp"
+#include "Streaming.hpp"
+#include "TileScheduler.hpp"
+#include "Trace.hpp"
+
+static int usage() {
+	std::cerr << "usage: cellbase-batch <config> <input glob> <output dir> [--workers n] [--chunk n] [--first-index n] [--threads n] [--ext .png] [--trace path]" << std::endl;
+	return 2;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 4) {
+		return usage();
+	}
+
+	const std::string configPath = argv[1];
+	const std::string inputPattern = argv[2];
+	const std::filesystem::path outputDir = argv[3];
+	size_t workerCount = std::max(1u, std::thread::hardware_concurrency());
+	size_t chunkSize = 4;
+	uint64_t firstIndex = 0;
+	int threadCount = 0;
+	std::string extension = ".png";
+	std::string tracePath;
+
+	for (int i = 4; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			return usage();
+		}
+
+		if (arg == "--workers") {
+			workerCount = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (arg == "--chunk") {
+			chunkSize = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (arg == "--first-index") {
+			firstIndex = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--threads") {
+			threadCount = std::atoi(argv[++i]);
+		}
+		else if (arg == "--ext") {
+			extension = argv[++i];
+		}
+		else if (arg == "--trace") {
+			tracePath = argv[++i];
+		}
+		else {
+			return usage();
+		}
+	}
+
+	try {
+		// Everything is checked before the first frame is read.
+		const auto config = PipelineConfig::load(configPath);
+
+		std::vector<cv::String> srcImgPaths;
+		cv::glob(inputPattern, srcImgPaths, false);
+		if (srcImgPaths.empty()) {
+			std::cerr << "no input matches " << inputPattern << std::endl;
+			return 1;
+		}
+
+		std::filesystem::create_directories(outputDir);
+		TileScheduler::setThreadCount(threadCount);
+		if (!tracePath.empty()) {
+			trace::setEnabled(true);
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		streamFramesParallel(
+			srcImgPaths.size(),
+			[&](size_t index) {
+				cv::Mat srcImg = cv::imread(srcImgPaths[index], cv::IMREAD_UNCHANGED);
+				if (srcImg.empty()) {
+					CV_Error(cv::Error::StsBadArg, "cannot read " + srcImgPaths[index]);
+				}
+				if (srcImg.channels() == 1) {
+					cv::cvtColor(srcImg, srcImg, cv::COLOR_GRAY2BGR);
+				}
+				return srcImg;
+			},
+			[&, heldFrames = std::make_shared<HeldFrameCache>(2 * workerCount)] {
+				return [processor = IncrementalProcessor(config.graph(), config.outputName, heldFrames), firstIndex](const Frame& frame) mutable {
+					trace::Scope scope("frame", [] { return std::string("frame"); }, static_cast<int64_t>(frame.index));
+					cv::Mat dstImg = processor.process(frame.img, firstIndex + frame.index);
+					scope.setPixels(dstImg.total());
+					return dstImg;
+				};
+			},
+			[&](const Frame& frame) {
+				const auto dstPath = outputDir / (std::filesystem::path(srcImgPaths[frame.index]).stem().string() + extension);
+				if (!cv::imwrite(dstPath.string(), frame.img)) {
+					CV_Error(cv::Error::StsBadArg, "cannot write " + dstPath.string());
+				}
+			},
+			workerCount, (workerCount + 1) * chunkSize, chunkSize);
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << srcImgPaths.size() << " frames in " << seconds << " s (" << srcImgPaths.size() / seconds << " frames/s)" << std::endl;
+
+		if (!tracePath.empty()) {
+			trace::setEnabled(false);
+			trace::writeSummary(std::cout);
+			if (!trace::writeChromeTrace(tracePath)) {
+				std::cerr << "cannot write " << tracePath << std::endl;
+				return 1;
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
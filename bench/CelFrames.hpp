@@ -0,0 +1,65 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Synthetic cel frames shared by cellbase-bench and cellbase-equivalence.
+
+inline const std::vector<std::vector<cv::Vec3b>> targetColorsList = {
+	{ cv::Vec3b(111, 105, 161), cv::Vec3b(144, 160, 130), cv::Vec3b(163, 168, 165), cv::Vec3b(150, 155, 156) },
+	{ cv::Vec3b(41, 38, 40), cv::Vec3b(97, 57, 70) },
+	{ cv::Vec3b(2, 2, 1), cv::Vec3b(44, 17, 10) },
+	{ cv::Vec3b(28, 9, 11), cv::Vec3b(112, 72, 87) },
+};
+
+inline const cv::Vec3b lineColor(4, 2, 10);
+
+// White background, flat ellipses in the target colors outlined in line color, and stray pixels of
+// any color as antialiasing leaves. Shapes scale with the frame, so every size has the same proportions.
+inline cv::Mat makeCelFrame(cv::Size size, unsigned seed) {
+	std::mt19937 random(seed);
+	auto uniform = [&](double lo, double hi) {
+		return std::uniform_real_distribution<double>(lo, hi)(random);
+	};
+
+	std::vector<cv::Vec3b> colors;
+	for (const auto& targetColors : targetColorsList) {
+		colors.insert(colors.end(), targetColors.begin(), targetColors.end());
+	}
+
+	cv::Mat img(size, CV_8UC3, cv::Scalar(255, 255, 255));
+	const double lineWidth = std::max(1.0, size.height / 360.0);
+	for (int shape = 0; shape < 40; shape++) {
+		const double centerX = uniform(0, size.width);
+		const double centerY = uniform(0, size.height);
+		const double radiusX = uniform(0.03, 0.2) * size.width;
+		const double radiusY = uniform(0.03, 0.2) * size.height;
+		const cv::Vec3b color = colors[random() % colors.size()];
+
+		const int startY = std::max(0, static_cast<int>(centerY - radiusY));
+		const int endY = std::min(size.height, static_cast<int>(centerY + radiusY) + 1);
+		const int startX = std::max(0, static_cast<int>(centerX - radiusX));
+		const int endX = std::min(size.width, static_cast<int>(centerX + radiusX) + 1);
+		for (int imgY = startY; imgY < endY; imgY++) {
+			auto row = img.ptr<cv::Vec3b>(imgY);
+			for (int imgX = startX; imgX < endX; imgX++) {
+				const double dx = (imgX - centerX) / radiusX;
+				const double dy = (imgY - centerY) / radiusY;
+				const double distance = std::sqrt(dx * dx + dy * dy);
+				if (distance >= 1.0) {
+					continue;
+				}
+				row[imgX] = (1.0 - distance) * std::min(radiusX, radiusY) < lineWidth ? lineColor : color;
+			}
+		}
+	}
+
+	for (int i = 0; i < size.area() / 200; i++) {
+		img.at<cv::Vec3b>(random() % size.height, random() % size.width) = cv::Vec3b(random() % 256, random() % 256, random() % 256);
+	}
+
+	return img;
+}
@@ -0,0 +1,161 @@
+// Checks that the fast paths give the same output as the paths they replace, on synthetic cel frames:
+//
+//   - LineRemover's wavefront engine against the iterative one, over tolerances and maxTimes
+//   - AnyLineRemover on 16-bit and BGRA plates against the 8-bit BGR result widened the same way
+//   - Pipeline's fused tiles against applying its filters one after another
+//   - IncrementalProcessor against running the graph on every whole frame
+//
+//   cellbase-equivalence
+//
+// Prints one line per mismatch and exits with 1 if there is any. Registered with CTest.
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "Filter.hpp"
+#include "CellBlur.hpp"
+#include "LineRemover.hpp"
+#include "ChalkFilter.hpp"
+#include "FilterGraph.hpp"
+#include "Incremental.hpp"
+#include "CelFrames.hpp"
+
+static int failureCount = 0;
+
+static void expectSame(const std::string& name, const cv::Mat& img, const cv::Mat& expectedImg) {
+	if (img.size() != expectedImg.size() || img.type() != expectedImg.type()) {
+		std::cout << "FAIL " << name << ": size or type differs" << std::endl;
+		failureCount++;
+		return;
+	}
+
+	const double maxDiff = cv::norm(img, expectedImg, cv::NORM_INF);
+	if (maxDiff != 0) {
+		std::cout << "FAIL " << name << ": differs by up to " << maxDiff << std::endl;
+		failureCount++;
+	}
+}
+
+static void expectTrue(const std::string& name, bool isTrue) {
+	if (!isTrue) {
+		std::cout << "FAIL " << name << std::endl;
+		failureCount++;
+	}
+}
+
+static void checkLineRemoverEngines(const cv::Mat& srcImg) {
+	for (const int tolerance : { 0, 2, 8 }) {
+		for (const int maxTimes : { 0, 1, 3, 12, 100 }) {
+			const std::vector<cv::Vec4b> lineColors = { { lineColor[0], lineColor[1], lineColor[2], static_cast<uchar>(tolerance) } };
+			const std::vector<cv::Vec4b> excludedColors = { { 255, 255, 255, 0 } };
+			LineRemover3b wavefront(lineColors, excludedColors, maxTimes, LineRemoverEngine::Wavefront);
+			LineRemover3b iterative(lineColors, excludedColors, maxTimes, LineRemoverEngine::Iterative);
+
+			const auto name = "LineRemover3b(tolerance " + std::to_string(tolerance) + ", maxTimes " + std::to_string(maxTimes) + ")";
+			expectSame(name, wavefront.apply(srcImg), iterative.apply(srcImg));
+		}
+	}
+}
+
+// 8-bit BGR widened to 16-bit (x 257) or given an opaque alpha channel, losslessly.
+template<typename T>
+static cv::Mat widen(const cv::Mat& img) {
+	cv::Mat dstImg(img.size(), cv::traits::Type<T>::value);
+	for (int imgY = 0; imgY < img.rows; imgY++) {
+		auto srcRow = img.ptr<cv::Vec3b>(imgY);
+		auto dstRow = dstImg.ptr<T>(imgY);
+		for (int imgX = 0; imgX < img.cols; imgX++) {
+			dstRow[imgX] = whitePixel<T>();
+			for (int c = 0; c < 3; c++) {
+				dstRow[imgX][c] = static_cast<typename T::value_type>(srcRow[imgX][c] * (whiteSample<typename T::value_type>() / 255));
+			}
+		}
+	}
+	return dstImg;
+}
+
+static void checkLineRemoverPixelTypes(const cv::Mat& srcImg) {
+	AnyLineRemover lineRemover({ { lineColor[0], lineColor[1], lineColor[2], 3 } }, { { 255, 255, 255, 0 } }, 12);
+	const cv::Mat dstImg = lineRemover.apply(srcImg);
+
+	expectSame("AnyLineRemover 3w", lineRemover.apply(widen<cv::Vec3w>(srcImg)), widen<cv::Vec3w>(dstImg));
+	expectSame("AnyLineRemover 4b", lineRemover.apply(widen<cv::Vec4b>(srcImg)), widen<cv::Vec4b>(dstImg));
+	expectSame("AnyLineRemover 4w", lineRemover.apply(widen<cv::Vec4w>(srcImg)), widen<cv::Vec4w>(dstImg));
+}
+
+static void checkFusedPipelines(const cv::Mat& srcImg) {
+	const std::vector<std::vector<std::shared_ptr<Filter>>> chains = {
+		{ std::make_shared<LineOnly>(), std::make_shared<AveragingBlur>(2, 2), std::make_shared<Choke>(10) },
+		{ std::make_shared<::GaussianBlur>(2.0f, 5), std::make_shared<SobelX>(), std::make_shared<AveragingBlur>(3, 3) },
+		{ std::make_shared<FixedGaussianBlur<5, 2.0f>>(), std::make_shared<SobelAbsXY>(), std::make_shared<LineOnly>() },
+		{ std::make_shared<LineOnly>(), std::make_shared<::CellBlur>(20.0f, 21, targetColorsList), std::make_shared<FixedAveragingBlur<3, 3>>() },
+	};
+
+	for (size_t i = 0; i < chains.size(); i++) {
+		cv::Mat serialImg = srcImg;
+		for (const auto& filter : chains[i]) {
+			serialImg = filter->apply(serialImg);
+		}
+
+		expectSame("Pipeline chain " + std::to_string(i), Pipeline(chains[i]).apply(srcImg), serialImg);
+	}
+}
+
+static FilterGraph localGraph() {
+	FilterGraph graph;
+	const auto lines = graph.add(FilterGraph::source, { std::make_shared<LineOnly>(), std::make_shared<AveragingBlur>(3, 3) });
+	const auto blurred = graph.add(FilterGraph::source, std::make_shared<::GaussianBlur>(2.0f, 5));
+	graph.setOutput("cell", graph.compositeLayers({ FilterGraph::source, blurred, lines }, { 0.7, 0.3 }));
+	return graph;
+}
+
+static void checkIncremental(cv::Size size) {
+	IncrementalProcessor processor(localGraph(), "cell");
+	const auto graph = localGraph();
+
+	// A held frame, small changes, and a cut to another shot.
+	cv::Mat img = makeCelFrame(size, 1);
+	for (int frameIdx = 0; frameIdx < 10; frameIdx++) {
+		if (frameIdx % 3 == 1) {
+			const cv::Rect changeRect((frameIdx * 37) % (size.width - 32), (frameIdx * 53) % (size.height - 24), 32, 24);
+			makeCelFrame(changeRect.size(), 100 + frameIdx).copyTo(img(changeRect));
+		}
+		if (frameIdx == 6) {
+			img = makeCelFrame(size, 2);
+		}
+
+		const cv::Mat frameImg = img.clone();
+		expectSame("IncrementalProcessor frame " + std::to_string(frameIdx), processor.process(frameImg, frameIdx), graph.run(frameImg).at("cell"));
+	}
+	expectTrue("IncrementalProcessor reuses held frames", processor.reusedFrames > 0);
+	expectTrue("IncrementalProcessor patches changed frames", processor.patchedFrames > 0);
+
+	// Output keyed by frame index is never reused from another frame.
+	FilterGraph chalkGraph;
+	chalkGraph.setOutput("chalk", chalkGraph.add(FilterGraph::source, std::make_shared<ChalkFilter>(7)));
+	IncrementalProcessor chalkProcessor(chalkGraph, "chalk");
+	for (int frameIdx = 0; frameIdx < 3; frameIdx++) {
+		ChalkFilter chalk(7);
+		chalk.setFrameIndex(frameIdx);
+		expectSame("IncrementalProcessor ChalkFilter frame " + std::to_string(frameIdx), chalkProcessor.process(img, frameIdx), chalk.apply(img));
+	}
+}
+
+int main() {
+	const cv::Mat srcImg = makeCelFrame(cv::Size(640, 360), 1);
+
+	checkLineRemoverEngines(srcImg);
+	checkLineRemoverPixelTypes(srcImg);
+	checkFusedPipelines(srcImg);
+	checkIncremental(cv::Size(640, 360));
+
+	if (failureCount > 0) {
+		std::cout << failureCount << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "all checks passed" << std::endl;
+	return 0;
+}
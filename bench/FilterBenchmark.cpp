@@ -0,0 +1,281 @@
+// Times every filter and compositing function on synthetic cel frames and writes the results as JSON.
+//
+//   cellbase-bench [--output bench_results.json] [--frames 720p,1080p,4k] [--filter name] [--min-time seconds]
+//
+// Each case is run once to warm up, then until --min-time has passed (at least 3 times). The reported
+// time is the median run. Allocations count operator new and cv::Mat buffers, per frame.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "Filter.hpp"
+#include "CellBlur.hpp"
+#include "LineRemover.hpp"
+#include "ChalkFilter.hpp"
+#include "CelFrames.hpp"
+
+static std::atomic<size_t> allocationCount{ 0 };
+static std::atomic<size_t> allocatedBytes{ 0 };
+
+// Kept out of line: once GCC inlines the malloc/free pair into callers it reports every new/delete
+// as mismatched (-Wmismatched-new-delete).
+#if defined(_MSC_VER)
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+BENCH_NOINLINE void* operator new(std::size_t size) {
+	allocationCount++;
+	allocatedBytes += size;
+	if (void* ptr = std::malloc(size > 0 ? size : 1)) {
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+BENCH_NOINLINE void operator delete(void* ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+// cv::Mat buffers do not go through operator new; this counts them and leaves the work to OpenCV's own allocator.
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+		cv::UMatData* u = cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+		if (u != nullptr && data == nullptr) {
+			allocationCount++;
+			allocatedBytes += u->size;
+		}
+		return u;
+	}
+
+	bool allocate(cv::UMatData* data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override {
+		return cv::Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+	}
+
+	void deallocate(cv::UMatData* data) const override {
+		cv::Mat::getStdAllocator()->deallocate(data);
+	}
+};
+
+struct BenchmarkFrame {
+	std::string name;
+	cv::Mat img;
+	std::vector<cv::Mat> layers; // img and two layers made from it, for the compositing cases
+};
+
+struct BenchmarkCase {
+	std::string name;
+	std::function<cv::Mat(const BenchmarkFrame&)> run;
+};
+
+struct BenchmarkResult {
+	std::string caseName;
+	std::string frameName;
+	cv::Size size;
+	int iterations;
+	double seconds; // median per frame
+	double allocations; // per frame
+	double allocatedBytes; // per frame
+
+	double megapixelsPerSecond() const {
+		return size.area() / seconds * 1e-6;
+	}
+
+	double nsPerPixel() const {
+		return seconds * 1e9 / size.area();
+	}
+};
+
+BenchmarkFrame makeBenchmarkFrame(const std::string& name, cv::Size size) {
+	BenchmarkFrame frame{ name, makeCelFrame(size, 1), {} };
+	frame.layers = { frame.img, ::GaussianBlur(2.0f, 5).apply(frame.img), applyFilters(frame.img, { std::make_shared<LineOnly>() }) };
+	return frame;
+}
+
+std::vector<BenchmarkCase> benchmarkCases() {
+	auto filterCase = [](const std::string& name, std::shared_ptr<Filter> filter) {
+		return BenchmarkCase{ name, [filter](const BenchmarkFrame& frame) { return filter->apply(frame.img); } };
+	};
+
+	const std::vector<cv::Vec4b> lineColors = { { 4, 2, 10, 3 } };
+	const std::vector<cv::Vec4b> excludedColors = { { 255, 255, 255, 0 } };
+
+	return {
+		filterCase("AveragingBlur(3,3)", std::make_shared<AveragingBlur>(3, 3)),
+		filterCase("AveragingBlur(15,15)", std::make_shared<AveragingBlur>(15, 15)),
+		filterCase("GaussianBlur(2,5)", std::make_shared<::GaussianBlur>(2.0f, 5)),
+		filterCase("FixedGaussianBlur<5,2>", std::make_shared<FixedGaussianBlur<5, 2.0f>>()),
+		filterCase("SobelX", std::make_shared<SobelX>()),
+		filterCase("SobelY", std::make_shared<SobelY>()),
+		filterCase("SobelAbsXY", std::make_shared<SobelAbsXY>()),
+		filterCase("LineOnly", std::make_shared<LineOnly>()),
+		filterCase("Choke(10)", std::make_shared<Choke>(10)),
+		filterCase("CellBlur(20,21)", std::make_shared<::CellBlur>(20.0f, 21, targetColorsList)),
+		filterCase("LineRemover3b(100)", std::make_shared<LineRemover3b>(lineColors, excludedColors, 100)),
+		filterCase("ChalkFilter", std::make_shared<ChalkFilter>()),
+		filterCase("Pipeline(LineOnly,AveragingBlur,Choke)", std::make_shared<Pipeline>(std::vector<std::shared_ptr<Filter>>{
+			std::make_shared<LineOnly>(),
+			std::make_shared<AveragingBlur>(2, 2),
+			std::make_shared<Choke>(10),
+		})),
+		{ "applyLayers", [](const BenchmarkFrame& frame) { return applyLayers(frame.layers); } },
+		{ "compositeLayers", [](const BenchmarkFrame& frame) { return compositeLayers(frame.layers, { 0.7, 0.3 }); } },
+		{ "applyLayersWithAlpha", [](const BenchmarkFrame& frame) { return applyLayersWithAlpha(frame.layers[0], frame.layers[1], 0.5); } },
+		{ "applyAlpha", [](const BenchmarkFrame& frame) { return applyAlpha(frame.img, 0.5); } },
+	};
+}
+
+BenchmarkResult runCase(const BenchmarkCase& benchmarkCase, const BenchmarkFrame& frame, double minSeconds) {
+	using Clock = std::chrono::steady_clock;
+
+	benchmarkCase.run(frame);
+
+	std::vector<double> times;
+	size_t allocations = 0;
+	size_t bytes = 0;
+	const auto start = Clock::now();
+	while (times.size() < 3 || std::chrono::duration<double>(Clock::now() - start).count() < minSeconds) {
+		const size_t startAllocations = allocationCount;
+		const size_t startBytes = allocatedBytes;
+		const auto runStart = Clock::now();
+		cv::Mat result = benchmarkCase.run(frame);
+		const auto runEnd = Clock::now();
+		allocations += allocationCount - startAllocations;
+		bytes += allocatedBytes - startBytes;
+
+		times.push_back(std::chrono::duration<double>(runEnd - runStart).count());
+	}
+
+	const int iterations = static_cast<int>(times.size());
+	std::nth_element(times.begin(), times.begin() + iterations / 2, times.end());
+
+	return BenchmarkResult{ benchmarkCase.name, frame.name, frame.img.size(), iterations, times[iterations / 2], static_cast<double>(allocations) / iterations, static_cast<double>(bytes) / iterations };
+}
+
+std::string simdName() {
+#if defined(CELLBASE_SIMD_AVX2)
+	return "AVX2";
+#elif defined(CELLBASE_SIMD_SSE2)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+void writeJson(std::ostream& stream, const std::vector<BenchmarkResult>& results) {
+	stream << std::setprecision(9);
+	stream << "{\n";
+	stream << "  \"opencv\": \"" << CV_VERSION << "\",\n";
+	stream << "  \"simd\": \"" << simdName() << "\",\n";
+	stream << "  \"threads\": " << cv::getNumThreads() << ",\n";
+	stream << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const auto& result = results[i];
+		stream << "    { \"name\": \"" << result.caseName << "\""
+			<< ", \"frame\": \"" << result.frameName << "\""
+			<< ", \"width\": " << result.size.width
+			<< ", \"height\": " << result.size.height
+			<< ", \"iterations\": " << result.iterations
+			<< ", \"seconds\": " << result.seconds
+			<< ", \"megapixelsPerSecond\": " << result.megapixelsPerSecond()
+			<< ", \"nsPerPixel\": " << result.nsPerPixel()
+			<< ", \"allocations\": " << result.allocations
+			<< ", \"allocatedBytes\": " << result.allocatedBytes
+			<< " }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	stream << "  ]\n";
+	stream << "}\n";
+}
+
+int main(int argc, char** argv) {
+	std::string outputPath = "bench_results.json";
+	std::string frameNames = "720p,1080p,4k";
+	std::string filterName;
+	double minSeconds = 1.0;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			std::cerr << "missing value for " << arg << std::endl;
+			return 1;
+		}
+
+		if (arg == "--output") {
+			outputPath = argv[++i];
+		}
+		else if (arg == "--frames") {
+			frameNames = argv[++i];
+		}
+		else if (arg == "--filter") {
+			filterName = argv[++i];
+		}
+		else if (arg == "--min-time") {
+			minSeconds = std::atof(argv[++i]);
+		}
+		else {
+			std::cerr << "unknown option " << arg << std::endl;
+			return 1;
+		}
+	}
+
+	const std::vector<std::pair<std::string, cv::Size>> frameSizes = {
+		{ "720p", cv::Size(1280, 720) },
+		{ "1080p", cv::Size(1920, 1080) },
+		{ "4k", cv::Size(3840, 2160) },
+	};
+
+	static CountingMatAllocator matAllocator;
+	cv::Mat::setDefaultAllocator(&matAllocator);
+
+	std::vector<BenchmarkResult> results;
+	const auto cases = benchmarkCases();
+	std::stringstream frameList(frameNames);
+	for (std::string frameName; std::getline(frameList, frameName, ',');) {
+		const auto frameSize = std::find_if(frameSizes.begin(), frameSizes.end(), [&](const auto& entry) { return entry.first == frameName; });
+		if (frameSize == frameSizes.end()) {
+			std::cerr << "unknown frame size " << frameName << std::endl;
+			return 1;
+		}
+
+		const auto frame = makeBenchmarkFrame(frameSize->first, frameSize->second);
+		for (const auto& benchmarkCase : cases) {
+			if (benchmarkCase.name.find(filterName) == std::string::npos) {
+				continue;
+			}
+
+			const auto result = runCase(benchmarkCase, frame, minSeconds);
+			std::cout << std::left << std::setw(42) << result.caseName << std::setw(7) << result.frameName << std::right << std::fixed
+				<< std::setw(10) << std::setprecision(1) << result.megapixelsPerSecond() << " MP/s"
+				<< std::setw(9) << std::setprecision(2) << result.nsPerPixel() << " ns/px"
+				<< std::setw(9) << std::setprecision(1) << result.allocations << " allocs" << std::endl;
+			results.push_back(result);
+		}
+	}
+
+	std::ofstream output(outputPath);
+	if (!output) {
+		std::cerr << "cannot write " << outputPath << std::endl;
+		return 1;
+	}
+	writeJson(output, results);
+
+	return 0;
+}